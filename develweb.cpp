@@ -1,13 +1,23 @@
 
 #ifdef _WIN32
 #include <direct.h>
+#include <process.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define WAPPBUILD_IO_URING
+#endif
 #endif
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <set>
 #include <map>
@@ -15,6 +25,16 @@
 #include <unordered_set>
 #include <algorithm>
 #include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <memory>
 
 #ifdef _WIN32
 	static char path_separator='\\';
@@ -23,19 +43,36 @@
 #endif
 
 	template<typename Fn>
-	static std::string trim(const std::string &src, Fn && fn) {
-		if (src.empty()) return src;
-		auto b = src.begin();
-		auto e = src.end();
-		while (b != e && fn(*b)) ++b;
-		while (b != e) {
-			--e;
-			if (!fn(*e)) {
-				++e;
-				break;
-			}
+	static std::string_view trim(std::string_view src, Fn && fn) {
+		std::size_t b = 0;
+		std::size_t e = src.length();
+		while (b != e && fn(src[b])) ++b;
+		while (b != e && fn(src[e-1])) --e;
+		return src.substr(b, e-b);
+	}
+
+	///Calls fn for every line of the content, the line is passed without the separator
+	template<typename Fn>
+	static void for_each_line(std::string_view content, Fn && fn) {
+		std::size_t pos = 0;
+		while (pos < content.length()) {
+			auto nl = content.find('\n', pos);
+			if (nl == content.npos) nl = content.length();
+			fn(content.substr(pos, nl - pos));
+			pos = nl + 1;
+		}
+	}
+
+	///calls fn(begin, end) for every {{...}} placeholder on the line, begin is the position of '{{', end is behind '}}'
+	template<typename Fn>
+	static void for_each_placeholder(std::string_view line, Fn && fn) {
+		auto p = line.find("{{");
+		while (p != line.npos) {
+			auto q = line.find("}}", p+2);
+			if (q == line.npos) break;
+			fn(p, q+2);
+			p = line.find("{{", q+2);
 		}
-		return std::string(b,e);
 	}
 
 class OrderedSet {
@@ -62,6 +99,14 @@ public:
 	bool lock(const std::string &item) {
 		return container.insert(std::pair<std::string, int>(item,0)).second;
 	}
+	bool push_front(const std::string &item) {
+		int first = 0;
+		for (auto &&x: container) first = std::min(first, x.second);
+		return container.insert(std::pair<std::string, int>(item,first-1)).second;
+	}
+	bool erase(const std::string &item) {
+		return container.erase(item) != 0;
+	}
 
 	iterator begin() {return container.begin();}
 	const_iterator begin() const {return container.begin();}
@@ -107,9 +152,11 @@ public:
 	const PrefixSuffix comment_ps;
 	std::string outfile;
 
-	bool detect_require(const std::string &line, std::string &rest) const;
-	bool detect_include(const std::string &line, std::string &rest) const;
-	bool detect_directive(const std::string &line, std::string &rest, const char *directive) const;
+	bool detect_require(std::string_view line, std::string_view &rest) const;
+	bool detect_include(std::string_view line, std::string_view &rest) const;
+	bool detect_directive(std::string_view line, std::string_view &rest, const char *directive) const;
+	///Detects whole line comment, returns its trimmed content
+	bool detect_comment(std::string_view line, std::string_view &content) const;
 
 
 	bool locked = false;
@@ -123,11 +170,665 @@ public:
 	}
 };
 
+///Tracks, whether the position in a javascript source is inside of a string, a comment or a regular expression
+/** A slash is a division or a start of a regular expression depending on the previous token. When
+ * the scanner cannot decide (for example after '}' or '++'), it sets the flag 'uncertain' and
+ * the state is not reliable for the rest of the file */
+struct JsScanState {
+	///quote character (', " or `) when inside of a string, otherwise 0
+	char quote = 0;
+	bool block_comment = false;
+	bool line_comment = false;
+	///inside of a regular expression literal
+	bool regex = false;
+	///inside of a character class [...] of the regular expression
+	bool regex_class = false;
+	///the state can be wrong from some point of the file
+	bool uncertain = false;
+
+	///Advances the state over the text
+	void scan(std::string_view text);
+	///Updates the state at the end of the line, only template literals and block comments continue
+	void end_line() {
+		line_comment = false;
+		if (quote != '`') quote = 0;
+		if (regex) uncertain = true;
+		regex = regex_class = false;
+		in_word = false;
+	}
+	bool in_comment() const {return block_comment || line_comment;}
+	///Returns true, when the current string must stay a literal - it is a key of an object literal
+	///or a module specifier of import or export. The rest is the text of the line after the position
+	bool literal_only(std::string_view rest) const;
+
+protected:
+	enum class Slash {regex, division, unknown};
+	///meaning of a slash at the current position
+	Slash slash = Slash::regex;
+	///last character outside of strings, comments and whitespace
+	char prev = 0;
+	///last identifier, when the previous token is an identifier
+	std::string word;
+	///previous character and identifier before the current string
+	char string_prev = 0;
+	std::string string_word;
+	bool in_word = false;
+	bool property = false;
+	///for every open '(': true, when a statement (if, while, for, with) follows the ')'
+	std::vector<bool> parens;
+
+	static bool is_ident(char c) {
+		return isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$' || static_cast<unsigned char>(c) >= 0x80;
+	}
+	///keywords which can be followed by a regular expression
+	static bool is_keyword(const std::string &w) {
+		static const char *keywords[] = {"return","typeof","instanceof","in","of","new","delete","void",
+				"throw","case","do","else","yield","await"};
+		for (const char *k: keywords) if (w == k) return true;
+		return false;
+	}
+};
+
+void JsScanState::scan(std::string_view text) {
+	std::size_t n = text.length();
+	for (std::size_t i = 0; i < n && !line_comment; i++) {
+		char c = text[i];
+		if (block_comment) {
+			if (c == '*' && i+1 < n && text[i+1] == '/') {
+				block_comment = false;
+				++i;
+			}
+		} else if (quote) {
+			if (c == '\\') ++i;
+			else if (c == quote) {
+				quote = 0;
+				slash = Slash::division;
+			} else if (quote == '`' && c == '$' && i+1 < n && text[i+1] == '{') {
+				//expressions in template literals are not tracked
+				uncertain = true;
+			}
+		} else if (regex) {
+			if (c == '\\') ++i;
+			else if (c == '[') regex_class = true;
+			else if (c == ']') regex_class = false;
+			else if (c == '/' && !regex_class) {
+				regex = false;
+				slash = Slash::division;
+			}
+		} else if (c == '/' && i+1 < n && text[i+1] == '/') {
+			line_comment = true;
+		} else if (c == '/' && i+1 < n && text[i+1] == '*') {
+			block_comment = true;
+			++i;
+		} else if (isspace(static_cast<unsigned char>(c))) {
+			in_word = false;
+		} else {
+			if (is_ident(c)) {
+				if (!in_word) {
+					word.clear();
+					property = prev == '.';
+				}
+				word.push_back(c);
+				in_word = true;
+				slash = !property && is_keyword(word)?Slash::regex:Slash::division;
+			} else {
+				bool cond = false;
+				in_word = false;
+				switch (c) {
+					case '"':
+					case '\'':
+					case '`':
+						quote = c;
+						string_prev = prev;
+						string_word = property?std::string():word;
+						break;
+					case '/':
+						if (slash == Slash::regex) regex = true;
+						else if (slash == Slash::unknown) uncertain = true;
+						slash = Slash::regex;
+						break;
+					case '(':
+						parens.push_back(!property && (word == "if" || word == "while" || word == "for" || word == "with"));
+						slash = Slash::regex;
+						break;
+					case ')':
+						if (!parens.empty()) {
+							cond = parens.back();
+							parens.pop_back();
+						}
+						slash = cond?Slash::regex:Slash::division;
+						break;
+					case ']': slash = Slash::division; break;
+					case '}': slash = Slash::unknown; break;
+					case '+':
+					case '-': slash = prev == c?Slash::unknown:Slash::regex; break;
+					default: slash = Slash::regex; break;
+				}
+				word.clear();
+			}
+			prev = c;
+		}
+	}
+}
+
+bool JsScanState::literal_only(std::string_view rest) const {
+	if (quote != '"' && quote != '\'') return false;
+	if (string_word == "from" || string_word == "import" || string_word == "as") return true;
+	std::size_t i = 0;
+	while (i < rest.length() && rest[i] != quote) {
+		if (rest[i] == '\\') ++i;
+		++i;
+	}
+	if (i >= rest.length()) return false;
+	rest = trim(rest.substr(i+1), isspace);
+	if (!rest.empty() && rest[0] == ':') return string_prev == '{' || string_prev == ',';
+	return rest.substr(0,2) == "as" && (rest.length() == 2 || !is_ident(rest[2]));
+}
+
+namespace DataURI {
+	bool is_local(const std::string &url);
+}
+
+///Rule @import of a local stylesheet
+struct CssImport {
+	std::string url;
+	///name of the layer, empty for anonymous layer
+	std::string layer;
+	///condition of supports() without the function name
+	std::string supports;
+	std::string media;
+	bool has_layer = false;
+
+	///Parses the rule written on single line, returns false, when it is not @import of a local file
+	bool parse(std::string_view line);
+};
+
+bool CssImport::parse(std::string_view line) {
+	line = trim(line, isspace);
+	if (line.substr(0,7) != "@import" || line.empty() || line.back() != ';') return false;
+	line = trim(line.substr(7, line.length() - 8), isspace);
+	*this = CssImport();
+	std::string_view rest;
+	if (line.substr(0,4) == "url(") {
+		auto e = line.find(')');
+		if (e == line.npos) return false;
+		std::string_view u = trim(line.substr(4, e - 4), isspace);
+		if (u.length() >= 2 && (u[0] == '"' || u[0] == '\'') && u.back() == u[0]) u = u.substr(1, u.length() - 2);
+		url = u;
+		rest = line.substr(e + 1);
+	} else if (!line.empty() && (line[0] == '"' || line[0] == '\'')) {
+		auto e = line.find(line[0], 1);
+		if (e == line.npos) return false;
+		url = line.substr(1, e - 1);
+		rest = line.substr(e + 1);
+	} else {
+		return false;
+	}
+	rest = trim(rest, isspace);
+	if (rest.substr(0,6) == "layer(") {
+		auto e = rest.find(')');
+		if (e == rest.npos) return false;
+		layer = trim(rest.substr(6, e - 6), isspace);
+		has_layer = true;
+		rest = trim(rest.substr(e + 1), isspace);
+	} else if (rest.substr(0,5) == "layer" && (rest.length() == 5 || isspace(rest[5]))) {
+		has_layer = true;
+		rest = trim(rest.substr(5), isspace);
+	}
+	if (rest.substr(0,9) == "supports(") {
+		std::size_t depth = 0;
+		std::size_t e = 8;
+		for (; e < rest.length(); e++) {
+			if (rest[e] == '(') ++depth;
+			else if (rest[e] == ')' && --depth == 0) break;
+		}
+		if (e == rest.length()) return false;
+		supports = trim(rest.substr(9, e - 9), isspace);
+		rest = trim(rest.substr(e + 1), isspace);
+	}
+	media = rest;
+	return DataURI::is_local(url);
+}
+
+///Evaluates conditional blocks !if <name> ... !else ... !endif
+/** The condition is true, when the name is defined. The condition !if !<name>
+ * is true, when the name is not defined. Blocks can be nested */
+class Conditions {
+public:
+	typedef std::set<std::string, std::less<> > Defines;
+
+	Conditions(const Defines &defines, const std::string &fname):defines(defines),fname(fname) {}
+
+	///Processes the directive, returns true when it is a conditional directive
+	bool process(std::string_view directive);
+	///Processes line of the source file, the directive is written as a comment
+	bool process(const SourceContainer &cont, std::string_view line) {
+		std::string_view content;
+		return cont.detect_comment(line, content) && process(content);
+	}
+	///Returns true, when the current line is not excluded
+	bool active() const {return inactive == 0;}
+	///Checks, that all blocks are closed
+	void finish() const;
+
+protected:
+	const Defines &defines;
+	std::string fname;
+	struct Block {
+		bool taken;
+		bool has_else;
+	};
+	std::vector<Block> blocks;
+	///count of open blocks, which exclude lines
+	unsigned int inactive = 0;
+};
+
 static PrefixSuffix html={"<!--","-->"};
 static PrefixSuffix css={"/*","*/"};
 static PrefixSuffix js={"//",""};
 
 
+class CssIndex;
+class Builder;
+
+///Storage for strings which must persist until the build is finished
+/** Strings are copied to large blocks, which are never moved, so views to them remain valid */
+class StringArena {
+public:
+	std::string_view store(std::string_view s) {
+		if (s.length() > capacity - used) {
+			capacity = std::max(block_size, s.length());
+			blocks.emplace_back(new char[capacity]);
+			used = 0;
+		}
+		char *p = blocks.back().get() + used;
+		std::copy(s.begin(), s.end(), p);
+		used += s.length();
+		return std::string_view(p, s.length());
+	}
+protected:
+	static constexpr std::size_t block_size = 65536;
+	std::vector<std::unique_ptr<char[]> > blocks;
+	std::size_t used = 0;
+	std::size_t capacity = 0;
+};
+
+void write_dep_file(const std::string& depfile, const std::string& target, const std::unordered_set<std::string> &files, bool phony);
+
+///Scans source files for the language keys without translating them
+/** Files are scanned in parallel. Results are cached, so the scanner can be shared
+ * between builders of multiple languages
+ */
+class KeyScanner {
+public:
+	struct Ref {
+		std::string key;
+		unsigned int line;
+	};
+	typedef std::vector<Ref> Refs;
+	typedef std::vector<std::pair<std::string, const SourceContainer *> > FileList;
+
+	///Lines excluded by !if blocks are skipped, same as in the builders using the defines
+	explicit KeyScanner(const Conditions::Defines &defines):defines(defines) {}
+
+	///Scans files which are not in cache yet
+	void scan(const FileList &files);
+	///Retrieves keys of already scanned file
+	const Refs &get(const std::string &fname) const {return cache.find(fname)->second;}
+
+protected:
+	std::unordered_map<std::string, Refs> cache;
+	Conditions::Defines defines;
+
+	void scan_file(const std::string &fname, const SourceContainer *cont, Refs &refs) const;
+};
+
+///Reads many files at once
+/** On Linux, opens, reads and closes are submitted to io_uring in batches, so latency
+ * of the operations overlaps. When io_uring is not available, the files are read by
+ * a pool of threads */
+class BatchReader {
+public:
+	struct Result {
+		std::string data;
+		bool ok = false;
+	};
+
+	BatchReader() {}
+	~BatchReader();
+	BatchReader(const BatchReader &) = delete;
+	BatchReader &operator=(const BatchReader &) = delete;
+
+	///Reads all files, result at index corresponds to the file at the same index
+	std::vector<Result> read(const std::vector<std::string> &files);
+	///Reads single file
+	static bool read_file(const std::string &fname, std::string &data);
+
+protected:
+	void read_threads(const std::vector<std::string> &files, std::vector<Result> &res);
+
+#ifdef WAPPBUILD_IO_URING
+	static const unsigned ring_entries = 64;
+
+	int ring_fd = -1;
+	bool ring_failed = false;
+	///requests can be still in flight, so the ring and their buffers are never released
+	bool ring_abandoned = false;
+	void *sq_ptr = MAP_FAILED;
+	std::size_t sq_len = 0;
+	void *cq_ptr = MAP_FAILED;
+	std::size_t cq_len = 0;
+	io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+	std::size_t sqes_len = 0;
+	unsigned *sq_tail = nullptr, *sq_mask = nullptr, *sq_array = nullptr;
+	unsigned *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+	io_uring_cqe *cqes = nullptr;
+	unsigned queued = 0;
+
+	bool ring_init();
+	void ring_close();
+	io_uring_sqe *next_sqe();
+	///Submits queued requests and waits for completion of all of them
+	/** On error, it still waits for the requests which were already submitted, so fn
+	 * receives every result and buffers are no longer used by the kernel. When even the wait
+	 * fails, the ring is marked abandoned */
+	template<typename Fn> bool complete(Fn &&fn);
+	bool read_ring(const std::vector<std::string> &files, std::vector<Result> &res);
+#endif
+};
+
+bool BatchReader::read_file(const std::string &fname, std::string &data) {
+#ifndef _WIN32
+	int fd = open(fname.c_str(), O_RDONLY|O_CLOEXEC);
+	if (fd < 0) return false;
+	struct stat st;
+	bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+	if (ok) {
+		data.resize(static_cast<std::size_t>(st.st_size));
+		std::size_t pos = 0;
+		while (pos < data.size()) {
+			ssize_t r = pread(fd, &data[pos], data.size() - pos, pos);
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0) break;
+			pos += r;
+		}
+		data.resize(pos);
+	}
+	close(fd);
+	return ok;
+#else
+	std::ifstream in(fname, std::ios::in|std::ios::binary);
+	if (!in) return false;
+	std::ostringstream tmp;
+	tmp << in.rdbuf();
+	data = tmp.str();
+	return true;
+#endif
+}
+
+void BatchReader::read_threads(const std::vector<std::string> &files, std::vector<Result> &res) {
+	std::atomic<std::size_t> next(0);
+	auto worker = [&] {
+		std::size_t i;
+		while ((i = next++) < files.size()) {
+			res[i].ok = read_file(files[i], res[i].data);
+		}
+	};
+	//reading is bound to latency of the storage, so use more threads than cores
+	std::size_t cnt = std::min<std::size_t>(files.size(), 8);
+	std::vector<std::thread> threads;
+	for (std::size_t i = 1; i < cnt; i++) threads.emplace_back(worker);
+	worker();
+	for (auto &&t: threads) t.join();
+}
+
+std::vector<BatchReader::Result> BatchReader::read(const std::vector<std::string> &files) {
+	std::vector<Result> res(files.size());
+	if (files.size() == 1) {
+		res[0].ok = read_file(files[0], res[0].data);
+		return res;
+	}
+#ifdef WAPPBUILD_IO_URING
+	if (read_ring(files, res)) return res;
+#endif
+	read_threads(files, res);
+	return res;
+}
+
+BatchReader::~BatchReader() {
+#ifdef WAPPBUILD_IO_URING
+	ring_close();
+#endif
+}
+
+#ifdef WAPPBUILD_IO_URING
+
+bool BatchReader::ring_init() {
+	if (ring_fd >= 0) return true;
+	if (ring_failed) return false;
+	ring_failed = true;
+	//allows to test the fallback
+	if (std::getenv("WAPPBUILD_NO_IO_URING")) return false;
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	int fd = static_cast<int>(syscall(__NR_io_uring_setup, ring_entries, &params));
+	if (fd < 0) return false;
+	ring_fd = fd;
+
+	//all used operations must be supported by the kernel
+	std::vector<char> probe_buff(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+	io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(probe_buff.data());
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		ring_close();
+		return false;
+	}
+	for (int op: {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE}) {
+		if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+			ring_close();
+			return false;
+		}
+	}
+
+	sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+	sq_ptr = mmap(nullptr, sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	cq_ptr = mmap(nullptr, cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES));
+	if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+		ring_close();
+		return false;
+	}
+	char *sq = static_cast<char *>(sq_ptr);
+	char *cq = static_cast<char *>(cq_ptr);
+	sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+	ring_failed = false;
+	return true;
+}
+
+void BatchReader::ring_close() {
+	if (ring_abandoned) return;
+	if (sqes != MAP_FAILED) munmap(sqes, sqes_len);
+	if (cq_ptr != MAP_FAILED) munmap(cq_ptr, cq_len);
+	if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_len);
+	sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+	sq_ptr = cq_ptr = MAP_FAILED;
+	if (ring_fd >= 0) close(ring_fd);
+	ring_fd = -1;
+}
+
+io_uring_sqe *BatchReader::next_sqe() {
+	//this is the only producer, so the tail can be read without synchronization
+	unsigned tail = *sq_tail;
+	unsigned idx = tail & *sq_mask;
+	io_uring_sqe *sqe = sqes + idx;
+	std::memset(sqe, 0, sizeof(*sqe));
+	sq_array[idx] = idx;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++queued;
+	return sqe;
+}
+
+template<typename Fn>
+bool BatchReader::complete(Fn &&fn) {
+	unsigned to_submit = queued;
+	unsigned pending = queued;
+	queued = 0;
+	bool ok = true;
+	while (pending) {
+		int r = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+		if (r >= 0) {
+			to_submit -= std::min<unsigned>(to_submit, r);
+		} else if (errno != EINTR) {
+			ok = false;
+			if (to_submit) {
+				//requests which were not submitted never complete, wait for the others
+				pending -= to_submit;
+				to_submit = 0;
+			} else if (errno != EAGAIN && errno != EBUSY) {
+				//unable to wait, requests in flight still use the ring and the buffers
+				ring_abandoned = true;
+			}
+		}
+		unsigned head = *cq_head;
+		unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			const io_uring_cqe &cqe = cqes[head & *cq_mask];
+			fn(static_cast<std::size_t>(cqe.user_data), cqe.res);
+			++head;
+			--pending;
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		if (ring_abandoned) break;
+	}
+	return ok;
+}
+
+bool BatchReader::read_ring(const std::vector<std::string> &files, std::vector<Result> &res) {
+	if (!ring_init()) return false;
+	std::vector<int> fds(files.size(), -1);
+	for (std::size_t b = 0; b < files.size(); b += ring_entries) {
+		std::size_t e = std::min<std::size_t>(b + ring_entries, files.size());
+		for (std::size_t i = b; i < e; i++) {
+			io_uring_sqe *sqe = next_sqe();
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = reinterpret_cast<std::uintptr_t>(files[i].c_str());
+			sqe->open_flags = O_RDONLY|O_CLOEXEC;
+			sqe->user_data = i;
+		}
+		bool ok = complete([&](std::size_t i, int r) {fds[i] = r;});
+		//the data are read to buffers of the batch, which are leaked when the ring is abandoned
+		std::vector<std::string> bufs(e - b);
+		for (std::size_t i = b; ok && i < e; i++) {
+			struct stat st;
+			if (fds[i] < 0 || fstat(fds[i], &st) != 0 || !S_ISREG(st.st_mode)) continue;
+			res[i].ok = true;
+			std::string &buf = bufs[i - b];
+			buf.resize(static_cast<std::size_t>(st.st_size));
+			if (buf.empty()) continue;
+			io_uring_sqe *sqe = next_sqe();
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = fds[i];
+			sqe->addr = reinterpret_cast<std::uintptr_t>(&buf[0]);
+			sqe->len = static_cast<unsigned>(buf.size());
+			sqe->off = 0;
+			sqe->user_data = i;
+		}
+		std::vector<int> lengths(files.size(), 0);
+		ok = ok && complete([&](std::size_t i, int r) {lengths[i] = r;});
+		if (ring_abandoned) {
+			static_cast<void>(new std::vector<std::string>(std::move(bufs)));
+			bufs.assign(e - b, std::string());
+		}
+		for (std::size_t i = b; i < e; i++) {
+			res[i].data = std::move(bufs[i - b]);
+			if (!res[i].ok || res[i].data.empty()) continue;
+			if (!ok || lengths[i] < 0) {
+				res[i].ok = false;
+			} else {
+				//short read, continue synchronously
+				std::size_t pos = lengths[i];
+				while (pos < res[i].data.size()) {
+					ssize_t r = pread(fds[i], &res[i].data[pos], res[i].data.size() - pos, pos);
+					if (r < 0 && errno == EINTR) continue;
+					if (r <= 0) break;
+					pos += r;
+				}
+				res[i].data.resize(pos);
+			}
+		}
+		for (std::size_t i = b; ok && i < e; i++) {
+			if (fds[i] < 0) continue;
+			io_uring_sqe *sqe = next_sqe();
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = fds[i];
+			sqe->user_data = i;
+		}
+		if (ok) ok = complete([&](std::size_t i, int) {fds[i] = -1;});
+		//descriptors not closed by the ring, also the ones opened before an error
+		for (std::size_t i = b; i < e; i++) {
+			if (fds[i] >= 0) close(fds[i]);
+		}
+		if (!ok) {
+			//the ring is broken, read the rest by threads
+			ring_close();
+			ring_failed = true;
+			for (std::size_t i = b; i < files.size(); i++) res[i] = Result();
+			std::vector<std::string> rest(files.begin() + b, files.end());
+			std::vector<Result> rest_res(rest.size());
+			read_threads(rest, rest_res);
+			std::move(rest_res.begin(), rest_res.end(), res.begin() + b);
+			return true;
+		}
+	}
+	return true;
+}
+
+#endif
+
+///Content of source files, every file is read only once during the build
+class SourceCache {
+public:
+	///Reads all files, which are not in the cache yet, at once
+	void prefetch(const std::vector<std::string> &files);
+	///Returns content of the file, or nullptr if the file cannot be read
+	const std::string *get(const std::string &fname);
+protected:
+	BatchReader reader;
+	std::unordered_map<std::string, BatchReader::Result> files;
+};
+
+void SourceCache::prefetch(const std::vector<std::string> &names) {
+	std::vector<std::string> missing;
+	for (auto &&x: names) {
+		if (files.find(x) == files.end()) missing.push_back(x);
+	}
+	std::sort(missing.begin(), missing.end());
+	missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+	if (missing.empty()) return;
+	auto res = reader.read(missing);
+	for (std::size_t i = 0; i < missing.size(); i++) {
+		files.emplace(std::move(missing[i]), std::move(res[i]));
+	}
+}
+
+const std::string *SourceCache::get(const std::string &fname) {
+	auto iter = files.find(fname);
+	if (iter == files.end()) {
+		BatchReader::Result r;
+		r.ok = BatchReader::read_file(fname, r.data);
+		iter = files.emplace(fname, std::move(r)).first;
+	}
+	return iter->second.ok?&iter->second.data:nullptr;
+}
+
 class Builder {
 public:
 
@@ -136,26 +837,88 @@ public:
 		:scripts(".js",{"//",""})
 		,styles(".css",{"/*","*/"})
 		,templates(".html",{"<!--","-->"})
-		,header(".hdr",{"<!--","-->"}) {}
+		,header(".hdr",{"<!--","-->"})
+		,imported_styles(".css",{"/*","*/"}) {}
 
 	void parse_page_file(const std::string &name);
 	void build_output();
 	void collapse_externals();
 	void collapse_customs();
+	void gen_service_worker();
+	void enable_report(bool gzip);
+	void write_report(const std::string &fname);
 	void create_dep_file(const std::string &depfile, const std::string &target, bool collapsed, bool phony);
+	void collect_deps(std::unordered_set<std::string> &files, bool collapsed);
+	std::string get_output_name() const;
+	static std::vector<std::string> extract_common(const std::vector<Builder *> &pages, std::size_t min_pages, const std::string &common_name);
 	void parse_lang_file(const std::string &langfile);
 	void gen_lang_file(const std::string &langfile);
-	void walk_includes(SourceContainer &container, std::string fname, bool force_container);
+	void scan_lang_keys(KeyScanner &scanner, bool collapsed);
+	void walk_includes(SourceContainer &container, std::string fname, bool force_container, const std::string &parent);
 	void set_root_dir(const std::string &root_dir);
 	void set_base_name(const std::string &out_file);
+	///Sets directory of the content addressed store of outputs
+	/** Targets of make (the page and files listed in <targets>) are written as regular files, because a link
+	 * to a stored content would have modification time of the content, which can be older than the sources */
+	void set_output_store(const std::string &dir, const std::string &targets);
+	///Sets directory of the persistent cache of translated files
+	void set_translation_cache(const std::string &dir) {cache_dir = dir;}
+	///Defines the name for the conditional blocks (!if <name>)
+	void define(const std::string &name) {defines.insert(name);}
 	SourceContainer  &chooseContainer(SourceContainer & current, std::string &fname);
 
 
 protected:
 	SourceContainer scripts, styles, templates, header;
+	///stylesheets inlined by @import (!flatten_imports)
+	SourceContainer imported_styles;
 	std::map<std::string, SourceContainer> customContainers;
-	std::map<std::string, std::string> langfile;
-	std::set<std::string> missing_lang;
+	std::map<std::string, std::string, std::less<> > langfile;
+	std::set<std::string, std::less<> > missing_lang;
+	std::map<std::string, std::vector<std::string> > missing_lang_refs;
+	std::vector<std::string> page_files;
+	std::string cur_page;
+	///first file which required the module
+	std::unordered_map<std::string_view, std::string_view> required_by;
+	///storage of strings referenced by the views above
+	StringArena arena;
+	///content of all sources, shared by graph walk and collapse
+	SourceCache sources;
+	Conditions::Defines defines;
+	std::string store_dir;
+	///outputs which are never linked to the store
+	std::unordered_set<std::string> make_targets;
+	///Returns the store for the output, or empty string when the output is a target of make
+	const std::string &output_store(const std::string &fname) const;
+	///rendered custom containers included by !include @name, the key contains also the type of the includer
+	std::unordered_map<std::string, std::string> rendered_containers;
+	bool flatten_imports = false;
+	std::string cache_dir;
+	///when set, every missing key found by the translation is recorded here
+	std::vector<std::string> *missing_log = nullptr;
+	///stylesheets currently inlined by @import, to detect cycles
+	std::vector<std::string> import_stack;
+
+	struct ReportItem {
+		std::string module;
+		std::size_t raw;
+		std::size_t translated;
+		std::size_t gzip;
+	};
+	struct ReportOutput {
+		std::string file;
+		std::vector<ReportItem> modules;
+		///size of the written file and its compressed size
+		std::size_t size = 0;
+		std::size_t gzip = 0;
+	};
+	typedef std::vector<ReportOutput> Report;
+	///modules written to every output
+	Report report;
+	bool report_enabled = false;
+	bool report_gzip = false;
+	///Records size of the written output to the report
+	void report_written(std::size_t idx, const std::string &content);
 /*	std::string html_name;
 	std::string css_name;
 	std::string js_name;*/
@@ -165,19 +928,81 @@ protected:
 	std::string prefix;
 	std::string lang_file_name
 	;
+	std::string sw_file;
+	std::string common_script;
+	struct LazyGroup {
+		std::string id;
+		///output file, empty if the group is put to the page as <template>
+		std::string fragment;
+	};
+	std::vector<LazyGroup> lazy_groups;
+	///Chunk of the page loaded on demand (!lazy)
+	struct LazyChunk {
+		std::string name;
+		std::string dir;
+		std::vector<std::string> modules;
+	};
+	std::vector<LazyChunk> lazy_chunks;
+	///placeholders in collapsed scripts refer to the language table (!lang_table)
+	bool lang_table = false;
+	///set while the scripts, which use the language table, are rendered
+	bool use_lang_table = false;
+	///texts of the language table
+	std::vector<std::string> table_texts;
+	///maps key to the index in the language table
+	std::unordered_map<std::string, std::size_t> table_index;
+	///files which belong to a lazy chunk, maps file to the chunk index
+	std::unordered_map<std::string, std::size_t> chunk_files;
+	///files required by every walked file
+	std::unordered_map<std::string, std::vector<std::string> > require_graph;
+	///lazy templates, maps file to the group index
+	std::unordered_map<std::string, std::size_t> lazy_templates;
+	///files of modules listed by the page outside of !lazy_html
+	std::vector<std::string> eager_modules;
+	std::string common_style;
+	std::size_t inline_limit = 0;
+	std::unordered_map<std::string, std::string> inlined_assets;
 	bool async_css = false;
+	///styles are fetched from the head without blocking render (!defer_css early)
+	bool early_css = false;
+	bool minify_html = false;
+	bool prune_css = false;
+	std::vector<std::string> css_safelist;
+	bool register_sw = false;
 	bool async_script = false;
 	bool hasLang = false;
 	bool override_html_name = false;
 	bool override_css_name = false;
 	bool override_js_name = false;
 
-	static bool try_ext(const std::string &line, const char *ext, std::string &fullname);
+	bool try_ext(const std::string &line, const char *ext, std::string &fullname);
 	void includeFile(const SourceContainer *cont, std::ostream &out, const std::string &fname);
+	void renderFile(const SourceContainer *cont, std::ostream &out, const std::string &fname);
+	std::string resolve_asset(const SourceContainer &cont, const std::string &fname, const std::string &url) const;
+	const std::string *load_asset(const std::string &path);
+	void inline_assets(const SourceContainer &cont, const std::string &fname, std::string &line);
+	void collect_assets(const SourceContainer &cont, std::unordered_set<std::string> &files);
 
 	void collapse(SourceContainer &block, const std::string &outfile);
 	void collapse(SourceContainer &block, std::ostream &outfile);
-	void parse(const std::string &dir, std::istream &input);
+	void build_css_index(CssIndex &index) const;
+	///Returns the content without lines excluded by !if blocks
+	std::string active_lines(const SourceContainer &cont, const std::string &fname, std::string_view content) const;
+	void parse(const std::string &dir, std::string_view input);
+	void parse_module(const std::string &dir, std::string_view line);
+	void write_fragments();
+	///Templates required by eager modules are not lazy
+	void promote_templates();
+	void resolve_chunks(const std::string &page);
+	std::string chunk_output(const SourceContainer &cont, std::size_t chunk) const;
+	SourceContainer chunk_block(const SourceContainer &cont, std::size_t chunk) const;
+	bool is_lazy(const std::string &fname) const {return chunk_files.find(fname) != chunk_files.end();}
+	void build_chunk_loader(std::ostream &output);
+	std::string lang_table_file() const;
+	void write_lang_table();
+	bool is_cacheable(const SourceContainer *cont, const std::string &content) const;
+	std::string cache_entry_name(const SourceContainer *cont, const std::string &content) const;
+	bool replay_cache_entry(const std::string &entry, std::ostream &out);
 	void build(std::ostream &output);
 	void parse_file(const std::string &fname);
 
@@ -185,46 +1010,666 @@ private:
 	static void error_reading(const std::string& file);
 	static void error_writing(const std::string& file);
 	template<typename Out>
-	void translate_file(const SourceContainer *cont, std::ifstream &in, Out &&out);
+	void translate_file(const SourceContainer *cont, const std::string &fname, std::string_view content, Out &&out);
 	template<typename Out>
 	void scan_variable(std::istream& in, Out &&out);
-	void parseOutputLine(const std::string &line);
+	void parseOutputLine(std::string_view line);
 };
 
 class OStreamOut {
 public:
 
 	OStreamOut(std::ostream &out):out(out) {}
-	void operator()(const std::string &s) const {out << s << std::endl;}
+	void operator()(std::string_view s) const {out << s << '\n';}
+protected:
+	std::ostream &out;
+};
+
+class StringOut {
+public:
+
+	StringOut(std::string &out):out(out) {}
+	void operator()(std::string_view s) const {out.append(s);out.push_back('\n');}
+protected:
+	std::string &out;
+};
+
+bool beginsWith(std::string_view subject, const char *test);
+bool endsWith(std::string_view subject, const char *test);
+bool checkKw(const char *name, std::string_view &dir);
+void write_json_string(std::ostream &out, const std::string &s);
+
+///Minifies HTML written through the stream
+/** Collapses whitespace, removes whitespace around block elements and removes
+ * comments except conditional comments. Content of <pre>, <textarea>, <script>
+ * and <style> is copied unmodified
+ */
+class HtmlMinifier: public std::streambuf {
+public:
+
+	HtmlMinifier(std::ostream &out):out(out) {setp(buffer, buffer+sizeof(buffer));}
+	~HtmlMinifier() {finish();}
+
+	void finish();
+
 protected:
+	virtual int overflow(int c) override;
+	virtual int sync() override;
+	void feed(char c);
+	void end_tag_name(char c);
+	static bool is_block(const std::string &name);
+
+	enum State {text, tag_name, tag, quoted, comment, raw};
+
 	std::ostream &out;
+	char buffer[4096];
+	State state = text;
+	///pending whitespace in text, zero if none
+	char ws = 0;
+	///pending whitespace inside of tag
+	bool tag_ws = false;
+	///previous tag was block element (whitespace after it can be removed)
+	bool block_before = true;
+	char quote = 0;
+	std::string name;
+	std::string raw_end;
+	std::size_t raw_match = 0;
+	bool enter_raw = false;
+};
+
+int HtmlMinifier::overflow(int c) {
+	sync();
+	if (c != EOF) feed(static_cast<char>(c));
+	return c == EOF?0:c;
+}
+
+int HtmlMinifier::sync() {
+	for (char *c = pbase(); c != pptr(); ++c) feed(*c);
+	setp(buffer, buffer+sizeof(buffer));
+	out.flush();
+	return 0;
+}
+
+void HtmlMinifier::finish() {
+	sync();
+	if (state == tag_name) out << '<' << name;
+	else if (state == comment) out << "<!--" << name;
+	state = text;
+	name.clear();
+	out.flush();
+}
+
+bool HtmlMinifier::is_block(const std::string &name) {
+	static const std::unordered_set<std::string> blocks = {
+			"!doctype","html","head","body","title","meta","link","base","script","style",
+			"div","p","ul","ol","li","dl","dt","dd","table","thead","tbody","tfoot",
+			"tr","td","th","caption","h1","h2","h3","h4","h5","h6","section","article",
+			"aside","header","footer","nav","main","form","fieldset","legend","template",
+			"hr","br","pre","blockquote","figure","figcaption","address","noscript",
+	};
+	return blocks.find(name) != blocks.end();
+}
+
+void HtmlMinifier::end_tag_name(char c) {
+	bool closing = name[0] == '/';
+	std::string tname = closing?name.substr(1):name;
+	std::transform(tname.begin(), tname.end(), tname.begin(), tolower);
+	bool block = is_block(tname);
+	if (ws && !block && !block_before) out.put(ws);
+	ws = 0;
+	out.put('<');
+	out << name;
+	block_before = block;
+	enter_raw = !closing && (tname == "pre" || tname == "textarea" || tname == "script" || tname == "style");
+	if (enter_raw) raw_end = "</" + tname;
+	state = tag;
+	tag_ws = false;
+	feed(c);
+}
+
+void HtmlMinifier::feed(char c) {
+	switch (state) {
+	case text:
+		if (isspace(c)) {
+			ws = (ws == '\n' || c == '\n' || c == '\r')?'\n':' ';
+		} else if (c == '<') {
+			state = tag_name;
+			name.clear();
+		} else {
+			if (ws && !block_before) out.put(ws);
+			ws = 0;
+			out.put(c);
+			block_before = false;
+		}
+		break;
+	case tag_name:
+		if (isalnum(c) || (name.empty() && (c == '/' || c == '!')) || (!name.empty() && c == '-')) {
+			name.push_back(c);
+			if (name == "!--") {
+				state = comment;
+				name.clear();
+			}
+		} else if (name.empty()) {
+			state = text;
+			if (ws && !block_before) out.put(ws);
+			ws = 0;
+			out.put('<');
+			block_before = false;
+			feed(c);
+		} else {
+			end_tag_name(c);
+		}
+		break;
+	case tag:
+		if (c == '"' || c == '\'') {
+			if (tag_ws) out.put(' ');
+			tag_ws = false;
+			quote = c;
+			state = quoted;
+			out.put(c);
+		} else if (isspace(c)) {
+			tag_ws = true;
+		} else if (c == '>') {
+			out.put(c);
+			tag_ws = false;
+			if (enter_raw) {
+				state = raw;
+				raw_match = 0;
+				enter_raw = false;
+			} else {
+				state = text;
+			}
+		} else {
+			if (tag_ws) out.put(' ');
+			tag_ws = false;
+			out.put(c);
+		}
+		break;
+	case quoted:
+		out.put(c);
+		if (c == quote) state = tag;
+		break;
+	case comment:
+		name.push_back(c);
+		if (c == '>' && endsWith(name, "-->")) {
+			//keep conditional comments
+			if (name[0] == '[' || (name[0] == '<' && name[1] == '!')) {
+				if (ws && !block_before) out.put(ws);
+				ws = 0;
+				out << "<!--" << name;
+			}
+			name.clear();
+			state = text;
+		}
+		break;
+	case raw:
+		out.put(c);
+		if (static_cast<char>(tolower(c)) == raw_end[raw_match]) {
+			if (++raw_match == raw_end.length()) {
+				state = tag;
+				tag_ws = false;
+				block_before = true;
+			}
+		} else {
+			raw_match = c == '<'?1:0;
+		}
+		break;
+	}
+}
+
+///Read-only view to whole content of the file
+/** The file is mapped to the memory when it is possible, otherwise it is read to a buffer */
+class MappedFile {
+public:
+	MappedFile(const std::string &fname);
+	~MappedFile();
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	const char *data() const {return ptr;}
+	std::size_t size() const {return len;}
+	bool operator!() const {return !ok;}
+
+protected:
+	const char *ptr = "";
+	std::size_t len = 0;
+	bool ok = false;
+	bool mapped = false;
+	std::string buffer;
+};
+
+MappedFile::MappedFile(const std::string &fname) {
+#ifndef _WIN32
+	int fd = open(fname.c_str(), O_RDONLY|O_CLOEXEC);
+	if (fd >= 0) {
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+			len = static_cast<std::size_t>(st.st_size);
+			if (len == 0) {
+				ok = true;
+			} else {
+				void *m = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (m != MAP_FAILED) {
+					ptr = static_cast<const char *>(m);
+					mapped = ok = true;
+				} else {
+					len = 0;
+				}
+			}
+		}
+		close(fd);
+		if (ok) return;
+	}
+#endif
+	std::ifstream in(fname, std::ios::in|std::ios::binary);
+	if (!in) return;
+	std::ostringstream tmp;
+	tmp << in.rdbuf();
+	buffer = tmp.str();
+	ptr = buffer.data();
+	len = buffer.length();
+	ok = true;
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+	if (mapped) munmap(const_cast<char *>(ptr), len);
+#endif
+}
+
+///Returns true, when the content has no placeholders and no directives, so it can be copied unmodified
+bool is_plain_source(const char *data, std::size_t size) {
+	const char *end = data + size;
+	const char *p = data;
+	while ((p = static_cast<const char *>(std::memchr(p, '{', end - p))) != nullptr) {
+		if (++p != end && *p == '{') return false;
+	}
+	p = data;
+	while ((p = static_cast<const char *>(std::memchr(p, '!', end - p))) != nullptr) {
+		if (end - p >= 8 && (std::memcmp(p, "!require", 8) == 0 || std::memcmp(p, "!include", 8) == 0)) return false;
+		if (end - p >= 3 && std::memcmp(p, "!if", 3) == 0) return false;
+		if (end - p >= 5 && std::memcmp(p, "!else", 5) == 0) return false;
+		if (end - p >= 6 && std::memcmp(p, "!endif", 6) == 0) return false;
+		++p;
+	}
+	return true;
+}
+
+///Index of tag names, ids and classes used by the page
+class CssIndex {
+public:
+	///Adds all tags, ids and classes found in html code
+	void scan_html(const char *data, std::size_t size);
+	///Adds item of safelist: '.class', '#id' or 'tag'. Trailing '*' matches any suffix
+	void add_safelist(const std::string &item);
+	///Returns false, when selector cannot match anything in the index
+	bool may_match(const std::string &selector) const;
+
+protected:
+	std::unordered_set<std::string> tags = {"html","head","body","meta","link","script","title"};
+	std::unordered_set<std::string> ids;
+	std::unordered_set<std::string> classes;
+	std::vector<std::string> prefixes;
+
+	bool contains(const std::unordered_set<std::string> &set, char kind, const std::string &name) const;
 };
 
-std::string dirname(const std::string &name) {
+static bool is_css_ident(char c) {
+	return isalnum(c) || c == '-' || c == '_' || (c & 0x80);
+}
+
+void CssIndex::scan_html(const char *data, std::size_t size) {
+	const char *end = data + size;
+	const char *p = data;
+	while ((p = static_cast<const char *>(std::memchr(p, '<', end - p))) != nullptr) {
+		++p;
+		const char *b = p;
+		while (p != end && (isalnum(*p) || *p == '-')) ++p;
+		if (p == b) continue;
+		std::string tag(b, p);
+		std::transform(tag.begin(), tag.end(), tag.begin(), tolower);
+		tags.insert(tag);
+		//attributes
+		while (p != end && *p != '>') {
+			while (p != end && isspace(*p)) ++p;
+			b = p;
+			while (p != end && *p != '=' && *p != '>' && !isspace(*p)) ++p;
+			std::string attr(b, p);
+			std::transform(attr.begin(), attr.end(), attr.begin(), tolower);
+			if (p == end || *p != '=') {
+				if (p == b && p != end && *p != '>') ++p;
+				continue;
+			}
+			++p;
+			const char *vb = p;
+			const char *ve;
+			if (p != end && (*p == '"' || *p == '\'')) {
+				char q = *p++;
+				vb = p;
+				while (p != end && *p != q) ++p;
+				ve = p;
+				if (p != end) ++p;
+			} else {
+				while (p != end && !isspace(*p) && *p != '>') ++p;
+				ve = p;
+			}
+			if (attr == "class") {
+				const char *c = vb;
+				while (c != ve) {
+					while (c != ve && isspace(*c)) ++c;
+					const char *cb = c;
+					while (c != ve && !isspace(*c)) ++c;
+					if (c != cb) classes.insert(std::string(cb, c));
+				}
+			} else if (attr == "id") {
+				ids.insert(std::string(vb, ve));
+			}
+		}
+	}
+}
+
+void CssIndex::add_safelist(const std::string &item) {
+	if (item.empty()) return;
+	if (item[item.length()-1] == '*') {
+		prefixes.push_back(item.substr(0, item.length()-1));
+	} else if (item[0] == '.') {
+		classes.insert(item.substr(1));
+	} else if (item[0] == '#') {
+		ids.insert(item.substr(1));
+	} else {
+		std::string tag = item;
+		std::transform(tag.begin(), tag.end(), tag.begin(), tolower);
+		tags.insert(tag);
+	}
+}
+
+bool CssIndex::contains(const std::unordered_set<std::string> &set, char kind, const std::string &name) const {
+	if (set.find(name) != set.end()) return true;
+	std::string full = kind?std::string(1, kind) + name:name;
+	for (auto &&x: prefixes) {
+		if (full.compare(0, x.length(), x) == 0) return true;
+	}
+	return false;
+}
+
+bool CssIndex::may_match(const std::string &selector) const {
+	std::size_t i = 0;
+	std::size_t len = selector.length();
+	bool compound_start = true;
+	//escapes are decoded, so .md\:flex is the class 'md:flex'
+	auto read_ident = [&] {
+		std::string name;
+		while (i < len) {
+			char c = selector[i];
+			if (is_css_ident(c)) {
+				name.push_back(c);
+				++i;
+			} else if (c == '\\' && i + 1 < len && selector[i+1] != '\n') {
+				++i;
+				std::size_t b = i;
+				while (i < len && i - b < 6 && isxdigit(static_cast<unsigned char>(selector[i]))) ++i;
+				if (i == b) {
+					name.push_back(selector[i++]);
+					continue;
+				}
+				unsigned long cp = std::strtoul(selector.substr(b, i - b).c_str(), nullptr, 16);
+				if (i < len && isspace(static_cast<unsigned char>(selector[i]))) ++i;
+				if (cp == 0 || cp > 0x10FFFF) cp = 0xFFFD;
+				//encode as utf-8, same as in the html
+				if (cp < 0x80) {
+					name.push_back(static_cast<char>(cp));
+				} else if (cp < 0x800) {
+					name.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+					name.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+				} else if (cp < 0x10000) {
+					name.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+					name.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+					name.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+				} else {
+					name.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+					name.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+					name.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+					name.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+				}
+			} else {
+				break;
+			}
+		}
+		return name;
+	};
+	auto skip_block = [&](char open, char close) {
+		int level = 0;
+		char quote = 0;
+		for (; i < len; ++i) {
+			char c = selector[i];
+			if (quote) {
+				if (c == quote) quote = 0;
+			} else if (c == '"' || c == '\'') {
+				quote = c;
+			} else if (c == open) {
+				++level;
+			} else if (c == close && --level == 0) {
+				++i;
+				return;
+			}
+		}
+	};
+	while (i < len) {
+		char c = selector[i];
+		if (c == '\\' || c == '&' || c == '|') {
+			//escaped tags, nesting and namespaces are not evaluated
+			return true;
+		} else if (c == '.') {
+			++i;
+			if (!contains(classes, '.', read_ident())) return false;
+			compound_start = false;
+		} else if (c == '#') {
+			++i;
+			if (!contains(ids, '#', read_ident())) return false;
+			compound_start = false;
+		} else if (c == '[') {
+			skip_block('[',']');
+			compound_start = false;
+		} else if (c == ':') {
+			while (i < len && selector[i] == ':') ++i;
+			read_ident();
+			if (i < len && selector[i] == '(') skip_block('(',')');
+			compound_start = false;
+		} else if (isspace(c) || c == '>' || c == '+' || c == '~') {
+			++i;
+			compound_start = true;
+		} else if (c == '*') {
+			++i;
+			compound_start = false;
+		} else if (compound_start && is_css_ident(c)) {
+			std::string tag = read_ident();
+			std::transform(tag.begin(), tag.end(), tag.begin(), tolower);
+			if (!contains(tags, 0, tag)) return false;
+			compound_start = false;
+		} else {
+			return true;
+		}
+	}
+	return true;
+}
+
+///Removes rules which cannot match anything in the index and duplicated rules
+class CssPruner {
+public:
+	CssPruner(const CssIndex &index, const std::string &css):index(index),css(css) {}
+
+	std::string run() {
+		std::string out;
+		prune(0, css.length(), out);
+		return out;
+	}
+
+protected:
+	const CssIndex &index;
+	const std::string &css;
+
+	struct Item {
+		std::string text;
+		///normalized text of rule, empty for other items
+		std::string key;
+	};
+
+	///finds end of the block starting by '{' at position pos (position after '}')
+	std::size_t block_end(std::size_t pos, std::size_t end) const;
+	///skips comment or string at the position, returns position after it, or pos if there is nothing
+	std::size_t skip_special(std::size_t pos, std::size_t end) const;
+	bool keep_rule(const std::string &prelude) const;
+	void prune(std::size_t b, std::size_t e, std::string &out) const;
+	static std::string normalize(const std::string &text);
+};
+
+std::size_t CssPruner::skip_special(std::size_t pos, std::size_t end) const {
+	if (css[pos] == '/' && pos + 1 < end && css[pos+1] == '*') {
+		auto x = css.find("*/", pos+2);
+		return x == css.npos || x + 2 > end?end:x+2;
+	}
+	if (css[pos] == '"' || css[pos] == '\'') {
+		char q = css[pos++];
+		while (pos < end && css[pos] != q && css[pos] != '\n') {
+			if (css[pos] == '\\') ++pos;
+			++pos;
+		}
+		return std::min(pos + 1, end);
+	}
+	return pos;
+}
+
+std::size_t CssPruner::block_end(std::size_t pos, std::size_t end) const {
+	int level = 0;
+	while (pos < end) {
+		auto n = skip_special(pos, end);
+		if (n != pos) {pos = n;continue;}
+		char c = css[pos++];
+		if (c == '{') ++level;
+		else if (c == '}' && --level == 0) return pos;
+	}
+	return end;
+}
+
+std::string CssPruner::normalize(const std::string &text) {
+	std::string res;
+	bool ws = false;
+	for (auto &&c: text) {
+		if (isspace(c)) {
+			ws = true;
+		} else {
+			if (ws && !res.empty()) res.push_back(' ');
+			ws = false;
+			res.push_back(c);
+		}
+	}
+	return res;
+}
+
+bool CssPruner::keep_rule(const std::string &prelude) const {
+	std::size_t b = 0;
+	int level = 0;
+	char quote = 0;
+	for (std::size_t i = 0; i <= prelude.length(); i++) {
+		char c = i < prelude.length()?prelude[i]:',';
+		if (quote) {
+			if (c == quote) quote = 0;
+		} else if (c == '"' || c == '\'') {
+			quote = c;
+		} else if (c == '(' || c == '[') {
+			++level;
+		} else if (c == ')' || c == ']') {
+			--level;
+		} else if (c == ',' && level == 0) {
+			if (index.may_match(normalize(prelude.substr(b, i - b)))) return true;
+			b = i + 1;
+		}
+	}
+	return false;
+}
+
+void CssPruner::prune(std::size_t b, std::size_t e, std::string &out) const {
+	std::vector<Item> items;
+	std::size_t pos = b;
+	while (pos < e) {
+		std::size_t start = pos;
+		char c = css[pos];
+		if (isspace(c)) {
+			while (pos < e && isspace(css[pos])) ++pos;
+			items.push_back(Item{css.substr(start, pos - start), std::string()});
+			continue;
+		}
+		auto n = skip_special(pos, e);
+		if (n != pos) {
+			items.push_back(Item{css.substr(start, n - start), std::string()});
+			pos = n;
+			continue;
+		}
+		//find end of prelude - '{' or ';'
+		while (pos < e && css[pos] != '{' && css[pos] != ';' && css[pos] != '}') {
+			n = skip_special(pos, e);
+			pos = n == pos?pos+1:n;
+		}
+		if (pos >= e || css[pos] != '{') {
+			if (pos < e) ++pos;
+			items.push_back(Item{css.substr(start, pos - start), std::string()});
+			continue;
+		}
+		std::string prelude = css.substr(start, pos - start);
+		std::size_t bend = block_end(pos, e);
+		if (c == '@') {
+			std::string name = prelude.substr(0, prelude.find_first_of(" \t\r\n({"));
+			if (name == "@media" || name == "@supports" || name == "@layer" || name == "@container" || name == "@document") {
+				std::string inner;
+				prune(pos + 1, bend - 1, inner);
+				if (!normalize(inner).empty()) {
+					items.push_back(Item{prelude + "{" + inner + "}", std::string()});
+				}
+			} else {
+				items.push_back(Item{css.substr(start, bend - start), std::string()});
+			}
+		} else if (keep_rule(prelude)) {
+			std::string text = css.substr(start, bend - start);
+			items.push_back(Item{text, normalize(text)});
+		}
+		pos = bend;
+	}
+	//keep last of duplicated rules
+	std::unordered_map<std::string, std::size_t> last;
+	for (std::size_t i = 0; i < items.size(); i++) {
+		if (!items[i].key.empty()) last[items[i].key] = i;
+	}
+	for (std::size_t i = 0; i < items.size(); i++) {
+		if (items[i].key.empty() || last[items[i].key] == i) out.append(items[i].text);
+	}
+}
+
+std::string dirname(std::string_view name) {
 	auto pos = name.rfind(path_separator);
 	if (pos == name.npos) return std::string();
-	else return name.substr(0,pos+1);
+	else return std::string(name.substr(0,pos+1));
 }
-std::string pardirname(const std::string &name) {
-	if (name.empty()) return name;
-	if (name[name.length()-1] == '/') return pardirname(name.substr(0,name.length()-1));
+std::string pardirname(std::string_view name) {
+	while (!name.empty() && name[name.length()-1] == '/') name.remove_suffix(1);
 	return dirname(name);
 }
 
-std::string strip_dir(const std::string &name) {
+std::string strip_dir(std::string_view name) {
 	auto pos = name.rfind(path_separator);
-	if (pos == name.npos) return name;
-	else return name.substr(pos+1);
+	if (pos == name.npos) return std::string(name);
+	else return std::string(name.substr(pos+1));
 }
-std::string strip_ext(const std::string &name) {
+std::string strip_ext(std::string_view name) {
+	//only a dot in the last path component starts the extension
 	auto pos = name.rfind('.');
-	if (pos == name.npos) return name;
-	else return name.substr(0,pos);
+	auto sep = name.find_last_of("/\\");
+	if (pos == name.npos || (sep != name.npos && pos < sep)) return std::string(name);
+	else return std::string(name.substr(0,pos));
 }
 
-std::string rel_to_abs(const std::string &dir, const std::string relpath) {
-	if (relpath.empty()) return dir;
-	if (dir.empty() || relpath[0] == path_separator) return relpath;
+std::string rel_to_abs(std::string_view dir, std::string_view relpath) {
+	if (relpath.empty()) return std::string(dir);
+	if (dir.empty() || relpath[0] == path_separator) return std::string(relpath);
 	std::string res;
 	res.reserve(dir.length()+relpath.length()+1);
 	res.append(dir);
@@ -232,17 +1677,60 @@ std::string rel_to_abs(const std::string &dir, const std::string relpath) {
 	res.append(relpath);
 	return res;
 }
-std::string abs_to_rel(const std::string &dir, const std::string abs_path) {
-	if (abs_path.empty()) return dir;
-	if (abs_path[0] == path_separator) return abs_path;
-	if (dir.empty()) return abs_path;
-	if (dir[dir.length()-1] != '/') return abs_to_rel(dir+"/", abs_path);
-	if (abs_path.substr(0,dir.length()) == dir) return abs_path.substr(dir.length());
-	else {
-		std::string up = "..";
-		up.push_back(path_separator);
-		up.append(abs_path);
-		return abs_to_rel(pardirname(dir),up);
+///Removes segments '.' and 'name/..' from the path
+std::string normalize_path(std::string_view path) {
+	std::vector<std::string_view> segs;
+	std::size_t leading = 0;
+	bool absolute = !path.empty() && path[0] == path_separator;
+	while (!path.empty()) {
+		auto p = path.find(path_separator);
+		std::string_view seg = path.substr(0, p);
+		path = p == path.npos?std::string_view():path.substr(p+1);
+		if (seg.empty() || seg == ".") continue;
+		if (seg == ".." && segs.size() > leading) segs.pop_back();
+		else if (seg == "..") {segs.push_back(seg); ++leading;}
+		else segs.push_back(seg);
+	}
+	std::string res(absolute?1:0, path_separator);
+	for (std::size_t i = 0; i < segs.size(); i++) {
+		if (i) res.push_back(path_separator);
+		res.append(segs[i]);
+	}
+	return res;
+}
+
+std::string abs_to_rel(std::string_view dir, std::string_view abs_path) {
+	if (abs_path.empty()) return std::string(dir);
+	if (abs_path[0] == path_separator) return std::string(abs_path);
+	if (dir.empty()) return std::string(abs_path);
+	//walk up from dir until it is prefix of the path, every step adds ../ before the path
+	std::size_t ups = 0;
+	bool slash = dir[dir.length()-1] != '/';
+	auto at = [&](std::size_t i) -> int {
+		if (i < ups * 3) return i % 3 == 2?path_separator:'.';
+		i -= ups * 3;
+		return i < abs_path.length()?abs_path[i]:-1;
+	};
+	auto result = [&](std::size_t skip) {
+		std::string res;
+		res.reserve(ups * 3 + abs_path.length());
+		for (std::size_t i = 0; i < ups; i++) res.append("..").push_back(path_separator);
+		res.append(abs_path);
+		return res.substr(std::min(skip, res.length()));
+	};
+	while (true) {
+		std::size_t len = dir.length() + (slash?1:0);
+		bool prefix = true;
+		for (std::size_t i = 0; prefix && i < len; i++) {
+			prefix = at(i) == (i < dir.length()?dir[i]:'/');
+		}
+		if (prefix) return result(len);
+		while (!dir.empty() && dir[dir.length()-1] == '/') dir.remove_suffix(1);
+		auto pos = dir.rfind(path_separator);
+		dir = pos == dir.npos?std::string_view():dir.substr(0, pos+1);
+		slash = false;
+		++ups;
+		if (dir.empty()) return result(0);
 	}
 }
 
@@ -254,9 +1742,9 @@ void changeDir(const std::string &dir) {
 	}
 }
 
-bool checkKw(const char *name, std::string &dir) {
-	std::string::size_type idx = 0;
-	std::string::size_type len = dir.length();
+bool checkKw(const char *name, std::string_view &dir) {
+	std::size_t idx = 0;
+	std::size_t len = dir.length();
 	while (name[idx] && idx<len) {
 		if (name[idx] != dir[idx]) return false;
 		++idx;
@@ -268,36 +1756,36 @@ bool checkKw(const char *name, std::string &dir) {
 
 
 void Builder::parse_file(const std::string &fname) {
-	std::ifstream f(fname);
+	MappedFile f(fname);
 	if (!f) {
 		error_reading(fname);
 	}
+	page_files.push_back(fname);
+	std::string prev_page = cur_page;
+	cur_page = fname;
+	std::string_view content(f.data(), f.size());
 	if (!hasLang) {
-		parse(dirname(fname),f);
+		parse(dirname(fname),content);
 	} else {
 		std::ostringstream tmpfile;
-		translate_file(nullptr, f,OStreamOut(tmpfile));
-		std::istringstream rdtmpfile(tmpfile.str());
-		parse(dirname(fname), rdtmpfile);
+		translate_file(nullptr, fname, content, OStreamOut(tmpfile));
+		parse(dirname(fname), tmpfile.str());
 	}
+	cur_page = prev_page;
 }
 
 
-void Builder::parseOutputLine(const std::string &line) {
-	  std::istringstream f(line);
-	  std::string name, fname;
-	  getline(f, name, ' ');
-	  getline(f, fname);
-
-	  name = trim(name,isspace);
-	  fname = trim(fname,isspace);
+void Builder::parseOutputLine(std::string_view line) {
+	  auto sep = line.find(' ');
+	  std::string_view name = trim(line.substr(0, sep),isspace);
+	  std::string_view fname = sep == line.npos?std::string_view():trim(line.substr(sep+1),isspace);
 
 
-	  if (fname.empty()) throw std::runtime_error("Syntax error: !output "+line);
+	  if (fname.empty()) throw std::runtime_error("Syntax error: !output "+std::string(line));
 	  if (name.empty() || name[0] != '@')
-		  throw std::runtime_error("Syntax error: !container - container name must have prefix '@' "+line);
+		  throw std::runtime_error("Syntax error: !container - container name must have prefix '@' "+std::string(line));
 
-	  std::string extension;
+	  std::string_view extension;
 
 	  {
 		  auto p = fname.rfind('.');
@@ -315,26 +1803,34 @@ void Builder::parseOutputLine(const std::string &line) {
 		  ps = {"#",""};
 	  }
 
-	  SourceContainer cnt(extension, ps);
+	  SourceContainer cnt(std::string(extension), ps);
 	  cnt.outfile  = fname;
-	  if (!customContainers.insert(std::make_pair(name, cnt)).second) {
-		  throw std::runtime_error("Duplicate: !container " + line);
+	  if (!customContainers.insert(std::make_pair(std::string(name), cnt)).second) {
+		  throw std::runtime_error("Duplicate: !container " + std::string(line));
 	  }
 
 }
 
-void Builder::parse(const std::string &dir, std::istream &input) {
+void Builder::parse(const std::string &dir, std::string_view input) {
 
-	std::string line,name;
-	while (!input.eof()) {
-
-		std::getline(input,line);
+	{
+		//!flatten_imports applies to the whole page file, modules above it included
+		Conditions cond(defines, cur_page);
+		for_each_line(input, [&](std::string_view line) {
+			line = trim(line,isspace);
+			if (line.empty() || line[0] == '#' || cond.process(line) || !cond.active()) return;
+			if (checkKw("!flatten_imports",line)) flatten_imports = line == "true" || line == "yes";
+		});
+	}
+	Conditions cond(defines, cur_page);
+	for_each_line(input, [&](std::string_view line) {
 		line = trim(line,isspace);
 		if (line.empty() || line[0] == '#') {
-			continue;
+			return;
+		} else if (cond.process(line) || !cond.active()) {
+			return;
 		} else if (checkKw("!include",line)) {
-			std::string fname = dir+line.substr(9);
-			parse_file(fname);
+			parse_file(rel_to_abs(dir,line));
 		} else if (checkKw("!html",line)) {
 			templates.outfile = line;
 			override_html_name = true;
@@ -344,6 +1840,10 @@ void Builder::parse(const std::string &dir, std::istream &input) {
 		} else if (checkKw("!js",line)) {
 			scripts.outfile = line;
 			override_js_name = true;
+		} else if (checkKw("!service_worker",line)) {
+			sw_file = line;
+		} else if (checkKw("!register_service_worker",line)) {
+			register_sw = line == "true" || line == "yes";
 		} else if (checkKw("!dir",line)) {
 			root_dir = line;
 		} else if (checkKw("!charset",line)) {
@@ -353,41 +1853,105 @@ void Builder::parse(const std::string &dir, std::istream &input) {
 		} else if (checkKw("!defer_script",line)) {
 			async_script = line == "true" || line == "yes";
 		} else if (checkKw("!defer_css",line)) {
-			async_css = line == "true" || line == "yes";
+			early_css = line == "early";
+			async_css = early_css || line == "true" || line == "yes";
+		} else if (checkKw("!prune_css",line)) {
+			prune_css = line == "true" || line == "yes";
+		} else if (checkKw("!css_safelist",line)) {
+			std::istringstream items{std::string(line)};
+			std::string item;
+			while (items >> item) css_safelist.push_back(item);
+		} else if (checkKw("!flatten_imports",line)) {
+			flatten_imports = line == "true" || line == "yes";
+		} else if (checkKw("!lang_table",line)) {
+			lang_table = line == "true" || line == "yes";
+		} else if (checkKw("!minify_html",line)) {
+			minify_html = line == "true" || line == "yes";
 		} else if (checkKw("!container",line)) {
 			parseOutputLine(line);
-		} else {
-			std::string fpath = rel_to_abs(dir,line);
-			bool ok = false;
-			if (try_ext(fpath, ".html", name)) {
-				walk_includes(templates,name,true);
-				ok = true;
-			}
-			if (try_ext(fpath, ".css", name)) {
-				ok = true;
-				walk_includes(styles, name,true);
-			}
-			if (try_ext(fpath, ".js", name)) {
-				ok = true;
-				walk_includes(scripts,name,true);
+		} else if (checkKw("!inline_assets",line)) {
+			inline_limit = std::strtoul(std::string(line).c_str(),nullptr,10);
+		} else if (checkKw("!lazy",line)) {
+			std::istringstream items{std::string(line)};
+			LazyChunk chunk;
+			chunk.dir = dir;
+			std::string module;
+			items >> chunk.name;
+			while (items >> module) chunk.modules.push_back(module);
+			if (chunk.modules.empty()) throw std::runtime_error("Syntax error: !lazy <name> <module>... "+std::string(line));
+			lazy_chunks.push_back(chunk);
+		} else if (checkKw("!lazy_html",line)) {
+			std::istringstream items{std::string(line)};
+			std::string module;
+			LazyGroup grp;
+			items >> module >> grp.fragment;
+			grp.id = strip_dir(module);
+			std::unordered_set<std::string> live;
+			for (auto &&x: templates) live.insert(x.first);
+			parse_module(dir, module);
+			for (auto &&x: templates) {
+				if (live.find(x.first) == live.end()) lazy_templates[x.first] = lazy_groups.size();
 			}
-			if (try_ext(fpath, ".hdr", name)) {
-				ok = true;
-				walk_includes(header, name,true);
-			}
-			if (!ok)
-				throw std::runtime_error("Cannot find module: "+ line + ".*");
+			lazy_groups.push_back(grp);
+		} else {
+			parse_module(dir, line);
+			std::string fpath = rel_to_abs(dir, line);
+			for (const char *ext: {".html", ".css", ".js", ".hdr"}) eager_modules.push_back(fpath+ext);
 		}
-	}
+	});
+	cond.finish();
 
 }
+
+void Builder::parse_module(const std::string &dir, std::string_view line) {
+	std::string name;
+	std::string fpath = rel_to_abs(dir,line);
+	bool ok = false;
+	sources.prefetch({fpath+".html", fpath+".css", fpath+".js", fpath+".hdr"});
+	if (try_ext(fpath, ".html", name)) {
+		walk_includes(templates,name,true, cur_page);
+		ok = true;
+	}
+	if (try_ext(fpath, ".css", name)) {
+		ok = true;
+		walk_includes(styles, name,true, cur_page);
+	}
+	if (try_ext(fpath, ".js", name)) {
+		ok = true;
+		walk_includes(scripts,name,true, cur_page);
+	}
+	if (try_ext(fpath, ".hdr", name)) {
+		ok = true;
+		walk_includes(header, name,true, cur_page);
+	}
+	if (!ok)
+		throw std::runtime_error("Cannot find module: "+ std::string(line) + ".*");
+}
+
 void Builder::build(std::ostream &output) {
 
 	output << "<!DOCTYPE html><html><head>" << std::endl;
+	std::vector<std::string> page_styles;
+	for (auto &&x: styles.getOrdered()) {
+		if (!is_lazy(x)) page_styles.push_back(x);
+	}
 	if (!async_css) {
-		for (auto &&x: styles.getOrdered()) {
+		for (auto &&x: page_styles) {
 			output << "<link href=\"" << abs_to_rel(root_dir,x) << "\" rel=\"stylesheet\" type=\"text/css\" />" << std::endl;
 		}
+	} else if (early_css) {
+		//stylesheets with media="print" don't block render, media is switched once loaded.
+		//styles_loaded is dispatched after all styles are loaded and the page is initialized
+		output << "<script type=\"text/javascript\">(function(){\"use strict\";var counts = " << page_styles.size() + 1 << ";"
+				"window.__wappbuild_css = function(){counts--;if (counts == 0) document.dispatchEvent( new Event(\"styles_loaded\"));};})();</script>" << std::endl;
+		for (auto &&x: page_styles) {
+			output << "<link href=\"" << abs_to_rel(root_dir,x) << "\" rel=\"stylesheet\" type=\"text/css\" media=\"print\" onload=\"this.onload=null;this.media='all';__wappbuild_css()\" />" << std::endl;
+		}
+		output << "<noscript>";
+		for (auto &&x: page_styles) {
+			output << "<link href=\"" << abs_to_rel(root_dir,x) << "\" rel=\"stylesheet\" type=\"text/css\" />";
+		}
+		output << "</noscript>" << std::endl;
 	}
 	for (auto &&x: header.getOrdered()) {
 		includeFile(&header,output, x);
@@ -401,23 +1965,43 @@ void Builder::build(std::ostream &output) {
 	output << "<body>"<< std::endl;
 
 	for (auto &&x: templates.getOrdered()) {
+		if (lazy_templates.find(x) != lazy_templates.end() || is_lazy(x)) continue;
 		includeFile(&templates, output, x);
 		output << std::endl;
  	}
+	for (std::size_t i = 0; i < lazy_groups.size(); i++) {
+		if (!lazy_groups[i].fragment.empty()) continue;
+		output << "<template id=\"" << lazy_groups[i].id << "\">" << std::endl;
+		for (auto &&x: templates.getOrdered()) {
+			auto iter = lazy_templates.find(x);
+			if (iter == lazy_templates.end() || iter->second != i) continue;
+			includeFile(&templates, output, x);
+			output << std::endl;
+		}
+		output << "</template>" << std::endl;
+	}
+	if (!lazy_chunks.empty()) {
+		build_chunk_loader(output);
+	}
+	if (!table_texts.empty()) {
+		output << "<script "<< (async_script?"defer":"") << " src=\"" << abs_to_rel(root_dir,lang_table_file()) << "\" type=\"text/javascript\"/></script>" << std::endl;
+	}
 	for (auto &&x: scripts.getOrdered()) {
+		if (is_lazy(x)) continue;
 		output << "<script "<< (async_script?"defer":"") << " src=\"" << abs_to_rel(root_dir,x) << "\" type=\"text/javascript\"/></script>" << std::endl;
  	}
-	if (async_css || !entry_point.empty()) {
+	bool sw = register_sw && !sw_file.empty();
+	if (async_css || sw || !entry_point.empty()) {
 		output << "<script type=\"text/javascript\">"<< std::endl;
 		output << "document.addEventListener(\"DOMContentLoaded\",function(){\"use strict\";";
 
-		if (async_css) {
+		if (async_css && !early_css) {
 
 			output << "var counts = 0;[";
 
 
 			const char *sep = "";
-			for (auto &&x: styles.getOrdered()) {
+			for (auto &&x: page_styles) {
 				output << sep << '"' << abs_to_rel(root_dir, x) << '"';
 				sep = ",";
 			}
@@ -429,9 +2013,15 @@ void Builder::build(std::ostream &output) {
 					"document.head.appendChild(f);});";
 
 		}
+		if (sw) {
+			output << "if (\"serviceWorker\" in navigator) navigator.serviceWorker.register(\"" << abs_to_rel(root_dir, rel_to_abs(root_dir, sw_file)) << "\");";
+		}
 		if (!entry_point.empty()) {
 			output << entry_point << ";";
 		}
+		if (early_css) {
+			output << "__wappbuild_css();";
+		}
 		output << "});"<<std::endl << "</script>" << std::endl;
 
 	}
@@ -442,14 +2032,135 @@ void Builder::build(std::ostream &output) {
 
 bool Builder::try_ext(const std::string& line, const char* ext,	std::string& fullname) {
 	fullname = line + ext;
-	std::fstream probe(fullname);
-	if (!probe) return false;
-	return true;
+	return sources.get(fullname) != nullptr;
 }
 
 void Builder::collapse_externals() {
+	std::vector<std::pair<SourceContainer *, std::size_t> > chunks;
+	for (std::size_t i = 0; i < lazy_chunks.size(); i++) {
+		for (SourceContainer *c: {&styles, &scripts}) {
+			SourceContainer block = chunk_block(*c, i);
+			if (block.begin() == block.end()) continue;
+			for (auto &&x: block) c->erase(x.first);
+			use_lang_table = lang_table && c == &scripts;
+			collapse(block, chunk_output(*c, i));
+			chunks.push_back(std::make_pair(c, i));
+		}
+	}
+	use_lang_table = false;
 	collapse(styles, rel_to_abs(root_dir, styles.outfile));
+	use_lang_table = lang_table;
 	collapse(scripts, rel_to_abs(root_dir, scripts.outfile));
+	use_lang_table = false;
+	if (lang_table) write_lang_table();
+	for (auto &&x: chunks) {
+		std::string out = chunk_output(*x.first, x.second);
+		x.first->push_back(out);
+		chunk_files[out] = x.second;
+	}
+	if (!common_style.empty()) styles.push_front(common_style);
+	if (!common_script.empty()) scripts.push_front(common_script);
+}
+
+std::vector<std::string> Builder::extract_common(const std::vector<Builder *> &pages, std::size_t min_pages, const std::string &common_name) {
+	std::vector<std::string> outputs;
+	for (bool js: {false, true}) {
+		auto container = [&](Builder *b) -> SourceContainer & {return js?b->scripts:b->styles;};
+		std::vector<std::vector<std::string> > orders;
+		std::unordered_map<std::string, std::size_t> count;
+		//rank of the module - first occurrence, used to order independent modules
+		std::unordered_map<std::string, std::size_t> rank;
+		for (auto &&b: pages) {
+			orders.emplace_back();
+			for (auto &&x: container(b).getOrdered()) {
+				if (!b->is_lazy(x)) orders.back().push_back(x);
+			}
+			for (auto &&x: orders.back()) {
+				++count[x];
+				rank.insert(std::make_pair(x, rank.size()));
+			}
+		}
+		std::unordered_set<std::string> shared;
+		for (auto &&x: count) {
+			if (x.second >= min_pages) shared.insert(x.first);
+		}
+
+		std::vector<std::string> common;
+		bool changed = true;
+		while (changed) {
+			changed = false;
+			//shared modules must be at the beginning of every page, so they can be loaded first
+			for (auto &&o: orders) {
+				bool prefix = true;
+				for (auto &&x: o) {
+					if (shared.find(x) == shared.end()) prefix = false;
+					else if (!prefix) changed = shared.erase(x) || changed;
+				}
+			}
+			//merge order of shared modules from all pages
+			std::unordered_map<std::string, std::vector<std::string> > edges;
+			std::unordered_map<std::string, std::size_t> indeg;
+			for (auto &&x: shared) indeg[x] = 0;
+			for (auto &&o: orders) {
+				const std::string *prev = nullptr;
+				for (auto &&x: o) {
+					if (shared.find(x) == shared.end()) break;
+					if (prev) {
+						edges[*prev].push_back(x);
+						++indeg[x];
+					}
+					prev = &x;
+				}
+			}
+			std::set<std::pair<std::size_t, std::string> > ready;
+			for (auto &&x: indeg) {
+				if (x.second == 0) ready.insert(std::make_pair(rank[x.first], x.first));
+			}
+			common.clear();
+			while (!ready.empty()) {
+				std::string x = ready.begin()->second;
+				ready.erase(ready.begin());
+				common.push_back(x);
+				for (auto &&y: edges[x]) {
+					if (--indeg[y] == 0) ready.insert(std::make_pair(rank[y], y));
+				}
+			}
+			if (common.size() != shared.size()) {
+				//conflicting order, these modules stay in pages
+				for (auto &&x: indeg) {
+					if (x.second) shared.erase(x.first);
+				}
+				changed = true;
+			}
+		}
+
+		if (common.empty()) continue;
+		//only pages which contain the shared modules load the shared file
+		std::vector<Builder *> users;
+		for (std::size_t i = 0; i < pages.size(); i++) {
+			if (!orders[i].empty() && shared.find(orders[i].front()) != shared.end()) users.push_back(pages[i]);
+		}
+		//the shared file is rendered once, so the pages must render the modules same way
+		Builder *owner = users[0];
+		bool same = std::all_of(users.begin(), users.end(), [&](const Builder *b) {
+			return b->inline_limit == owner->inline_limit && (js || b->flatten_imports == owner->flatten_imports);
+		});
+		if (!same) {
+			std::cerr << "Warning: pages render " << (js?"scripts":"styles") << " differently, shared modules are not extracted" << std::endl;
+			continue;
+		}
+		std::string outfile = rel_to_abs(owner->root_dir, common_name + (js?".js":".css"));
+		SourceContainer &first = container(owner);
+		SourceContainer block(first.extension, first.comment_ps);
+		for (auto &&x: common) block.push_back(x);
+		owner->collapse(block, outfile);
+		for (auto &&b: users) {
+			for (auto &&x: common) container(b).erase(x);
+			(js?b->common_script:b->common_style) = outfile;
+		}
+		outputs.push_back(outfile);
+	}
+	return outputs;
 }
 
 void Builder::collapse_customs() {
@@ -461,17 +2172,365 @@ void Builder::collapse_customs() {
 	}
 }
 
-
+
+///FNV-1a hash (64 bit)
+std::uint64_t fnv1a(const char *data, std::size_t len, std::uint64_t h = 14695981039346656037ULL) {
+	for (std::size_t i = 0; i < len; i++) {
+		h = (h ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+	}
+	return h;
+}
+
+std::string hash_to_string(std::uint64_t h) {
+	std::ostringstream res;
+	res << std::hex << std::setw(16) << std::setfill('0') << h;
+	return res.str();
+}
+
+///Calculates hash of the content of the file
+std::string content_hash(const std::string &fname) {
+	std::ifstream in(fname, std::ios::in|std::ios::binary);
+	if (!in) throw std::runtime_error("Error opening (reading) the file: " + fname);
+	std::uint64_t h = fnv1a(nullptr, 0);
+	char buff[8192];
+	while (in.read(buff, sizeof(buff)) || in.gcount()) {
+		h = fnv1a(buff, static_cast<std::size_t>(in.gcount()), h);
+	}
+	return hash_to_string(h);
+}
+
+///Suffix of temporary files, unique for the process
+std::string temp_suffix() {
+#ifdef _WIN32
+	return "." + std::to_string(_getpid()) + ".tmp";
+#else
+	return "." + std::to_string(getpid()) + ".tmp";
+#endif
+}
+
+///Writes the output file
+/** When the store directory is set, every distinct content is stored there once, under
+ * the hash of the content, and the output file is a hard link to it. Returns false on error */
+bool write_output(const std::string &fname, std::string_view content, const std::string &store_dir) {
+#ifndef _WIN32
+	struct stat st;
+	//the file can be a link to a stored content, which must not be overwritten
+	if (lstat(fname.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1) unlink(fname.c_str());
+	if (!store_dir.empty()) {
+		std::string name = strip_dir(fname);
+		auto p = name.rfind('.');
+		std::string blob = store_dir + path_separator + hash_to_string(fnv1a(content.data(), content.length()))
+				+ (p == name.npos?std::string():name.substr(p));
+		std::string suffix = temp_suffix();
+		bool ok = stat(blob.c_str(), &st) == 0 && static_cast<std::size_t>(st.st_size) == content.length();
+		if (!ok) {
+			//the same content can be stored by other build at the same time
+			std::string tmp = blob + suffix;
+			std::ofstream f(tmp, std::ios::out|std::ios::trunc|std::ios::binary);
+			f.write(content.data(), content.length());
+			f.close();
+			ok = !!f && rename(tmp.c_str(), blob.c_str()) == 0;
+			if (!ok) unlink(tmp.c_str());
+		}
+		if (ok) {
+			std::string tmp = fname + suffix;
+			unlink(tmp.c_str());
+			if (link(blob.c_str(), tmp.c_str()) == 0) {
+				if (rename(tmp.c_str(), fname.c_str()) == 0) return true;
+				unlink(tmp.c_str());
+			}
+		}
+		//links are not supported, write the file
+	}
+#endif
+	std::ofstream f(fname, std::ios::out|std::ios::trunc);
+	f.write(content.data(), content.length());
+	f.close();
+	return !!f;
+}
+
+void Builder::set_output_store(const std::string &dir, const std::string &targets) {
+	store_dir = dir;
+	std::istringstream items(targets);
+	std::string item;
+	while (items >> item) make_targets.insert(normalize_path(item));
+}
+
+const std::string &Builder::output_store(const std::string &fname) const {
+	static const std::string none;
+	return make_targets.find(normalize_path(fname)) == make_targets.end()?store_dir:none;
+}
+
+void Builder::gen_service_worker() {
+	if (sw_file.empty()) return;
+
+	std::string swname = rel_to_abs(root_dir, sw_file);
+	std::string swdir = dirname(swname);
+	std::vector<std::string> outputs;
+	outputs.push_back(rel_to_abs(root_dir, templates.outfile));
+	for (auto &&x: styles.getOrdered()) outputs.push_back(x);
+	for (auto &&x: scripts.getOrdered()) outputs.push_back(x);
+	for (auto &&c: customContainers) {
+		if (c.second.outfile[0] != '-') outputs.push_back(rel_to_abs(root_dir, c.second.outfile));
+	}
+	for (auto &&g: lazy_groups) {
+		if (!g.fragment.empty()) outputs.push_back(rel_to_abs(root_dir, g.fragment));
+	}
+	for (std::size_t i = 0; i < lazy_chunks.size(); i++) {
+		SourceContainer block = chunk_block(templates, i);
+		if (block.begin() != block.end()) outputs.push_back(chunk_output(templates, i));
+	}
+	if (!table_texts.empty()) outputs.push_back(lang_table_file());
+
+	std::ostringstream manifest;
+	std::string version;
+	const char *sep = "";
+	for (auto &&x: outputs) {
+		std::string hash = content_hash(x);
+		manifest << sep << std::endl << "\t\"" << abs_to_rel(swdir, x) << "\":\"" << hash << '"';
+		version.append(hash);
+		sep = ",";
+	}
+	version = hash_to_string(fnv1a(version.data(), version.length()));
+
+	std::ostringstream f;
+	std::string prefix = "wappbuild:" + strip_dir(templates.outfile) + ":";
+	f << "\"use strict\";" << std::endl
+	  << "var PRECACHE = {" << manifest.str() << std::endl << "};" << std::endl
+	  << "var CACHE_PREFIX = \"" << prefix << "\";" << std::endl
+	  << "var CACHE = CACHE_PREFIX + \"" << version << "\";" << std::endl
+	  << "self.addEventListener(\"install\",function(ev){"
+	  	  "ev.waitUntil(caches.open(CACHE).then(function(c){return c.addAll(Object.keys(PRECACHE));})"
+	  	  ".then(function(){return self.skipWaiting();}));});" << std::endl
+	  << "self.addEventListener(\"activate\",function(ev){"
+	  	  "ev.waitUntil(caches.keys().then(function(keys){return Promise.all(keys.filter(function(k){"
+	  	  "return k.indexOf(CACHE_PREFIX) == 0 && k != CACHE;}).map(function(k){return caches.delete(k);}));})"
+	  	  ".then(function(){return self.clients.claim();}));});" << std::endl
+	  << "self.addEventListener(\"fetch\",function(ev){"
+	  	  "if (ev.request.method != \"GET\") return;"
+	  	  "ev.respondWith(caches.open(CACHE).then(function(c){return c.match(ev.request,{ignoreSearch:true});})"
+	  	  ".then(function(r){return r || fetch(ev.request);}));});" << std::endl;
+	if (!write_output(swname, f.str(), output_store(swname))) error_writing(swname);
+}
+
+///Estimates size of the data compressed by gzip
+/** LZ77 parse with 32KB window and short hash chains. Literals are priced by their
+ * entropy, matches by usual size of deflate length and distance codes
+ */
+std::size_t gzip_estimate(const std::string &data) {
+	const std::uint32_t none = 0xFFFFFFFF;
+	std::vector<std::uint32_t> head(65536, none);
+	std::vector<std::uint32_t> prev(data.length(), none);
+	std::size_t counts[256] = {};
+	std::size_t literals = 0;
+	double bits = 0;
+	auto s = reinterpret_cast<const unsigned char *>(data.data());
+	std::size_t n = data.length();
+	auto insert = [&](std::size_t i) {
+		auto h = ((s[i] << 10) ^ (s[i+1] << 5) ^ s[i+2]) & 0xFFFF;
+		prev[i] = head[h];
+		head[h] = static_cast<std::uint32_t>(i);
+		return prev[i];
+	};
+	std::size_t i = 0;
+	while (i < n) {
+		std::size_t len = 0;
+		std::size_t dist = 0;
+		if (i + 3 <= n) {
+			std::uint32_t cand = insert(i);
+			for (int depth = 0; depth < 16 && cand != none && i - cand <= 32768; depth++, cand = prev[cand]) {
+				std::size_t l = 0;
+				while (i + l < n && l < 258 && s[cand+l] == s[i+l]) ++l;
+				if (l > len) {
+					len = l;
+					dist = i - cand;
+				}
+			}
+		}
+		if (len >= 3) {
+			bits += 9 + std::log2(static_cast<double>(dist)) + (len > 10?std::log2(static_cast<double>(len)):0);
+			for (std::size_t j = i + 1; j < i + len && j + 3 <= n; j++) insert(j);
+			i += len;
+		} else {
+			++counts[s[i]];
+			++literals;
+			++i;
+		}
+	}
+	for (auto &&c: counts) {
+		if (c) bits += c * std::log2(static_cast<double>(literals) / c);
+	}
+	return static_cast<std::size_t>(bits / 8) + 18;
+}
+
+void write_json_string(std::ostream &out, const std::string &s) {
+	out.put('"');
+	for (auto &&c: s) {
+		switch (c) {
+		case '"': out << "\\\""; break;
+		case '\\': out << "\\\\"; break;
+		case '\n': out << "\\n"; break;
+		case '\r': out << "\\r"; break;
+		case '\t': out << "\\t"; break;
+		default:
+			if (static_cast<unsigned char>(c) < 0x20) {
+				out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+			} else {
+				out.put(c);
+			}
+		}
+	}
+	out.put('"');
+}
+
+void Builder::enable_report(bool gzip) {
+	report_enabled = true;
+	report_gzip = gzip;
+}
+
+void Builder::report_written(std::size_t idx, const std::string &content) {
+	report[idx].size = content.length();
+	report[idx].gzip = report_gzip?gzip_estimate(content):0;
+}
+
+void Builder::write_report(const std::string &fname) {
+	//styles and scripts which are not collapsed are outputs by themselves
+	std::unordered_set<std::string> outputs;
+	for (auto &&x: report) outputs.insert(x.file);
+	for (auto &&c: {&styles, &scripts}) {
+		for (auto &&x: c->getOrdered()) {
+			if (outputs.insert(x).second) {
+				MappedFile mf(x);
+				std::string data(mf.data(), mf.size());
+				std::size_t gzip = report_gzip?gzip_estimate(data):0;
+				report.push_back(ReportOutput{x, {ReportItem{x, data.length(), data.length(), gzip}}, data.length(), gzip});
+			}
+		}
+	}
+
+	auto require_path = [&](const std::string &module) {
+		std::vector<std::string> path;
+		auto iter = required_by.find(module);
+		while (iter != required_by.end() && path.size() <= required_by.size()) {
+			path.emplace_back(iter->second);
+			iter = required_by.find(iter->second);
+		}
+		std::reverse(path.begin(), path.end());
+		return path;
+	};
+
+	std::ofstream json(fname, std::ios::out|std::ios::trunc);
+	if (!json) error_writing(fname);
+	std::string txtname = strip_ext(fname)+".txt";
+	if (txtname == fname) txtname = fname + ".txt";
+	std::ofstream txt(txtname, std::ios::out|std::ios::trunc);
+	if (!txt) error_writing(txtname);
+
+	json << "{\"outputs\":[";
+	const char *sep = "";
+	for (auto &&o: report) {
+		ReportItem total{o.file,0,0,0};
+		for (auto &&m: o.modules) {
+			total.raw += m.raw;
+			total.translated += m.translated;
+			total.gzip += m.gzip;
+		}
+		auto write_sizes = [&](const ReportItem &item) {
+			json << "\"raw\":" << item.raw << ",\"translated\":" << item.translated;
+			if (report_gzip) json << ",\"gzip\":" << item.gzip;
+		};
+		json << sep << std::endl << "{\"file\":";
+		write_json_string(json, o.file);
+		//size of the written file, including generated code and minification
+		json << ",\"size\":" << o.size;
+		if (report_gzip) json << ",\"size_gzip\":" << o.gzip;
+		json << ",";
+		write_sizes(total);
+		json << ",\"modules\":[";
+		const char *sep2 = "";
+		for (auto &&m: o.modules) {
+			json << sep2 << std::endl << "\t{\"file\":";
+			write_json_string(json, m.module);
+			json << ",";
+			write_sizes(m);
+			json << ",\"required_by\":[";
+			const char *sep3 = "";
+			for (auto &&r: require_path(m.module)) {
+				json << sep3;
+				write_json_string(json, r);
+				sep3 = ",";
+			}
+			json << "]}";
+			sep2 = ",";
+		}
+		json << "]}";
+		sep = ",";
+
+		auto sorted = o.modules;
+		std::stable_sort(sorted.begin(), sorted.end(), [](const ReportItem &a, const ReportItem &b) {
+			return a.translated > b.translated;
+		});
+		auto write_line = [&](const ReportItem &item, const std::string &name) {
+			txt << std::setw(10) << item.raw << std::setw(12) << item.translated;
+			if (report_gzip) txt << std::setw(10) << item.gzip;
+			txt << "  " << name << std::endl;
+		};
+		txt << o.file << std::endl;
+		txt << std::setw(10) << "raw" << std::setw(12) << "translated";
+		if (report_gzip) txt << std::setw(10) << "gzip";
+		txt << std::endl;
+		for (auto &&m: sorted) {
+			std::string name = m.module;
+			auto path = require_path(m.module);
+			if (!path.empty()) {
+				name.append("  (");
+				for (auto &&r: path) name.append(r).append(" > ");
+				name.resize(name.length()-3);
+				name.push_back(')');
+			}
+			write_line(m, name);
+		}
+		write_line(total, "total of modules");
+		txt << std::setw(22) << o.size;
+		if (report_gzip) txt << std::setw(10) << o.gzip;
+		txt << "  written" << std::endl;
+		txt << std::endl;
+	}
+	json << std::endl << "]}" << std::endl;
+	if (!json) error_writing(fname);
+}
+
 void Builder::create_dep_file(const std::string& depfile, const std::string& target, bool collapsed, bool phony) {
 
 	if (target.empty()) return create_dep_file(depfile, rel_to_abs(root_dir, templates.outfile), collapsed, phony);
 
 	std::unordered_set<std::string> files;
+	collect_deps(files, collapsed);
+	write_dep_file(depfile, target, files, phony);
+}
+
+void write_dep_file(const std::string& depfile, const std::string& target, const std::unordered_set<std::string> &files, bool phony) {
+	std::ofstream f(depfile, std::ios::trunc|std::ios::out);
+	if (!f) {
+		std::cerr << "Error writing to file: " << depfile << std::endl;
+	} else {
+		f << target << " " <<  depfile << " :";
+		for (auto &&x: files) {
+			f << "\\" << std::endl  << x;
+		}
+		if (phony) {
+			for (auto &&x: files) {
+					f << std::endl << x << ":" << std::endl;
+			}
+		}
+	}
+}
 
-	std::initializer_list<OrderedSet *> list_collapsed{
-			&templates, &styles, &scripts, &header,
+void Builder::collect_deps(std::unordered_set<std::string> &files, bool collapsed) {
+	std::initializer_list<SourceContainer *> list_collapsed{
+			&templates, &styles, &scripts, &header, &imported_styles,
 	};
-	std::initializer_list<OrderedSet *> list_debug{
+	std::initializer_list<SourceContainer *> list_debug{
 			&templates, &header,
 	};
 	auto &list=collapsed?list_collapsed:list_debug;
@@ -486,22 +2545,14 @@ void Builder::create_dep_file(const std::string& depfile, const std::string& tar
 			files.insert(x.first);
 		}
 	}
-
-	std::ofstream f(depfile, std::ios::trunc|std::ios::out);
-	if (!f) {
-		std::cerr << "Error writing to file: " << depfile << std::endl;
-	} else {
-		f << target << " " <<  depfile << " :";
-		for (auto &&x: files) {
-			f << "\\" << std::endl  << x;
-		}
-		if (phony) {
-			for (auto &&x: files) {
-					f << std::endl << x << ":" << std::endl;
-			}
-		}
+	if (inline_limit) {
+		for (auto &&y: list) collect_assets(*y, files);
+		for (auto &&y: customContainers) collect_assets(y.second, files);
 	}
+}
 
+std::string Builder::get_output_name() const {
+	return rel_to_abs(root_dir, templates.outfile);
 }
 
 void Builder::set_base_name(const std::string &basename) {
@@ -516,6 +2567,8 @@ inline void Builder::parse_page_file(const std::string& name) {
 	std::string basename = strip_ext(fname);
 	set_base_name(basename);
 	parse_file(name);
+	promote_templates();
+	resolve_chunks(name);
 /*	std::cout << root_dir << std::endl
 			<< html_name << std::endl
 			<< css_name << std::endl
@@ -527,10 +2580,161 @@ inline void Builder::parse_page_file(const std::string& name) {
 
 inline void Builder::build_output() {
 	std::string outname = rel_to_abs(root_dir, templates.outfile);
-	std::fstream outf(outname, std::ios::out|std::ios::trunc);
-	if (!outf) error_writing(outname);
-	build(outf);
-	if (!outf) error_writing(outname);
+	std::ostringstream outf;
+	std::size_t report_idx = report.size();
+	if (report_enabled) report.push_back(ReportOutput{outname, {}});
+	if (minify_html) {
+		HtmlMinifier minifier(outf);
+		std::ostream mf(&minifier);
+		build(mf);
+		minifier.finish();
+	} else {
+		build(outf);
+	}
+	std::string content = outf.str();
+	if (report_enabled) report_written(report_idx, content);
+	//the page is always a target of make
+	if (!write_output(outname, content, std::string())) error_writing(outname);
+	write_fragments();
+}
+
+void Builder::promote_templates() {
+	if (lazy_templates.empty()) return;
+	//a template required by a module outside of !lazy_html is live, even if it was walked as lazy first
+	std::vector<std::string> stack = std::move(eager_modules);
+	std::unordered_set<std::string> visited;
+	while (!stack.empty()) {
+		std::string f = std::move(stack.back());
+		stack.pop_back();
+		if (!visited.insert(f).second) continue;
+		lazy_templates.erase(f);
+		auto iter = require_graph.find(f);
+		if (iter != require_graph.end()) stack.insert(stack.end(), iter->second.begin(), iter->second.end());
+	}
+}
+
+void Builder::resolve_chunks(const std::string &page) {
+	if (lazy_chunks.empty()) return;
+	//files required by the page directly are never lazy
+	std::unordered_set<std::string> eager;
+	for (auto &&c: {&scripts, &styles, &templates, &header}) {
+		for (auto &&x: *c) eager.insert(x.first);
+	}
+	static const std::size_t shared = static_cast<std::size_t>(-1);
+	std::unordered_map<std::string, std::size_t> owner;
+	std::string prev_page = cur_page;
+	cur_page = page;
+	for (std::size_t i = 0; i < lazy_chunks.size(); i++) {
+		const LazyChunk &chunk = lazy_chunks[i];
+		std::vector<std::string> stack;
+		for (auto &&m: chunk.modules) {
+			parse_module(chunk.dir, m);
+			std::string fpath = rel_to_abs(chunk.dir, m);
+			for (const char *ext: {".html", ".css", ".js"}) stack.push_back(fpath+ext);
+		}
+		std::unordered_set<std::string> closure;
+		while (!stack.empty()) {
+			std::string f = std::move(stack.back());
+			stack.pop_back();
+			if (eager.find(f) != eager.end() || !closure.insert(f).second) continue;
+			auto iter = require_graph.find(f);
+			if (iter != require_graph.end()) stack.insert(stack.end(), iter->second.begin(), iter->second.end());
+		}
+		for (auto &&f: closure) {
+			auto r = owner.emplace(f, i);
+			if (!r.second) r.first->second = shared;
+		}
+	}
+	cur_page = prev_page;
+	//files required by multiple chunks are loaded with the page
+	for (auto &&x: owner) {
+		if (x.second != shared && (scripts.exists(x.first) || styles.exists(x.first) || templates.exists(x.first))) {
+			chunk_files.emplace(x.first, x.second);
+		}
+	}
+}
+
+std::string Builder::chunk_output(const SourceContainer &cont, std::size_t chunk) const {
+	return rel_to_abs(root_dir, strip_ext(cont.outfile) + "_" + lazy_chunks[chunk].name + cont.extension);
+}
+
+SourceContainer Builder::chunk_block(const SourceContainer &cont, std::size_t chunk) const {
+	SourceContainer block(cont.extension, cont.comment_ps);
+	for (auto &&x: cont.getOrdered()) {
+		auto iter = chunk_files.find(x);
+		if (iter != chunk_files.end() && iter->second == chunk) block.push_back(x);
+	}
+	return block;
+}
+
+void Builder::build_chunk_loader(std::ostream &output) {
+	output << "<script type=\"text/javascript\">var wappbuild_load=(function(){\"use strict\";var chunks={";
+	const char *sep = "";
+	for (std::size_t i = 0; i < lazy_chunks.size(); i++) {
+		output << sep;
+		write_json_string(output, lazy_chunks[i].name);
+		output << ":{s:[";
+		const char *sep2 = "";
+		for (auto &&x: chunk_block(styles, i).getOrdered()) {
+			output << sep2;
+			write_json_string(output, abs_to_rel(root_dir, x));
+			sep2 = ",";
+		}
+		output << "],j:[";
+		sep2 = "";
+		for (auto &&x: chunk_block(scripts, i).getOrdered()) {
+			output << sep2;
+			write_json_string(output, abs_to_rel(root_dir, x));
+			sep2 = ",";
+		}
+		output << "],h:";
+		SourceContainer html = chunk_block(templates, i);
+		if (html.begin() == html.end()) output << "null";
+		else write_json_string(output, abs_to_rel(root_dir, chunk_output(templates, i)));
+		output << "}";
+		sep = ",";
+	}
+	output << "},loaded={};"
+			"function css(u){return new Promise(function(ok,err){var f=document.createElement(\"link\");f.rel=\"stylesheet\";f.href=u;f.onload=ok;f.onerror=err;document.head.appendChild(f);});}"
+			"function js(u){return new Promise(function(ok,err){var f=document.createElement(\"script\");f.src=u;f.async=false;f.onload=ok;f.onerror=err;document.body.appendChild(f);});}"
+			"function html(u){return fetch(u).then(function(r){if (!r.ok) throw new Error(u);return r.text();}).then(function(t){document.body.insertAdjacentHTML(\"beforeend\",t);});}"
+			"return function(n){if (!loaded[n]) {var c=chunks[n];if (!c) return Promise.reject(new Error(\"Unknown chunk: \"+n));"
+			"loaded[n]=Promise.all(c.s.map(css).concat(c.h?[html(c.h)]:[])).then(function(){return Promise.all(c.j.map(js));});}"
+			"return loaded[n];};})();</script>" << std::endl;
+}
+
+std::string Builder::lang_table_file() const {
+	return rel_to_abs(root_dir, strip_ext(templates.outfile) + "_text.js");
+}
+
+void Builder::write_lang_table() {
+	std::string fname = lang_table_file();
+	std::ostringstream f;
+	f << "var wappbuild_text=[";
+	const char *sep = "";
+	for (auto &&x: table_texts) {
+		f << sep << std::endl;
+		write_json_string(f, x);
+		sep = ",";
+	}
+	f << "];" << std::endl;
+	if (!write_output(fname, f.str(), output_store(fname))) error_writing(fname);
+}
+
+void Builder::write_fragments() {
+	for (std::size_t i = 0; i < lazy_groups.size(); i++) {
+		if (lazy_groups[i].fragment.empty()) continue;
+		SourceContainer block(templates.extension, templates.comment_ps);
+		for (auto &&x: templates.getOrdered()) {
+			auto iter = lazy_templates.find(x);
+			if (iter != lazy_templates.end() && iter->second == i) block.push_back(x);
+		}
+		collapse(block, rel_to_abs(root_dir, lazy_groups[i].fragment));
+	}
+	for (std::size_t i = 0; i < lazy_chunks.size(); i++) {
+		SourceContainer block = chunk_block(templates, i);
+		if (block.begin() != block.end()) collapse(block, chunk_output(templates, i));
+	}
 }
 
 inline void Builder::set_root_dir(const std::string& root_dir) {
@@ -561,6 +2765,21 @@ void read_except(std::istream &f , const char *seq) {
 
 }
 
+void read_string (std::istream &f, std::string &str);
+
+///skips additional columns until end of line
+void skip_columns(std::istream &f) {
+	std::string dummy;
+	int c = f.get();
+	while (c == ' ' || c == '\t') c = f.get();
+	while (c == ',') {
+		read_string(f, dummy);
+		c = f.get();
+		while (c == ' ' || c == '\t') c = f.get();
+	}
+	if (c != EOF) f.putback(c);
+}
+
 void write_string(std::ostream &f, const std::string &s) {
 	f.put('"');
 	for (auto &&x: s) {
@@ -616,13 +2835,18 @@ inline void Builder::parse_lang_file(const std::string& file) {
 	std::string orgtext;
 	std::string translated_text;
 	std::string key;
-	while (!!f) {
+	//an empty file has no keys
+	int c = f.get();
+	while (c != EOF && isspace(c)) c = f.get();
+	if (c != EOF) f.putback(c);
+	while (!!f && c != EOF) {
 
 		read_string(f, ns);
 		read_except(f,",");
 		read_string(f, orgtext);
 		read_except(f,",");
 		read_string(f, translated_text);
+		skip_columns(f);
 		read_except(f,"\r\n");
 
 		key.clear();
@@ -633,26 +2857,79 @@ inline void Builder::parse_lang_file(const std::string& file) {
 		key.append(orgtext);
 		langfile[key] = translated_text;
 
-		int c = f.get();
-		while (c != EOF && isspace(c)) c = f.get();;
+		c = f.get();
+		while (c != EOF && isspace(c)) c = f.get();
 		if (c != EOF) f.putback(c);
 	}
 }
 
 void Builder::collapse(SourceContainer& block, const std::string& outfile) {
-	std::ofstream f(outfile, std::ios::trunc|std::ios::out);
-	if (!f) {
-		std::cerr << "Error writing to file: " << outfile << std::endl;
+	std::ostringstream f;
+	std::size_t report_idx = report.size();
+	if (report_enabled) report.push_back(ReportOutput{outfile, {}});
+	if (prune_css && &block == &styles) {
+		std::ostringstream buff;
+		collapse(block, buff);
+		CssIndex index;
+		build_css_index(index);
+		f << CssPruner(index, buff.str()).run();
+	} else if (minify_html && (block.extension == ".html" || block.extension == ".htm")) {
+		HtmlMinifier minifier(f);
+		std::ostream mf(&minifier);
+		collapse(block, mf);
 	} else {
-		for (auto &&x : block.getOrdered()) {
-			includeFile(&block, f, x);
-		}
-		f << std::endl;
+		collapse(block, f);
+	}
+	std::string content = f.str();
+	if (report_enabled) report_written(report_idx, content);
+	if (!write_output(outfile, content, output_store(outfile))) {
+		std::cerr << "Error writing to file: " << outfile << std::endl;
 	}
 	block.clear();
 	block.push_back(outfile);
 }
 
+void Builder::build_css_index(CssIndex &index) const {
+	std::vector<const SourceContainer *> list {&templates, &header};
+	for (auto &&y: customContainers) list.push_back(&y.second);
+	for (auto &&y: list) {
+		for (auto &&x: *y) {
+			if (endsWith(x.first, ".html") || endsWith(x.first, ".htm") || endsWith(x.first, ".hdr")) {
+				MappedFile mf(x.first);
+				if (!mf) error_reading(x.first);
+				std::string_view content(mf.data(), mf.size());
+				if (content.find("!if") == content.npos) {
+					index.scan_html(mf.data(), mf.size());
+				} else {
+					std::string active = active_lines(*y, x.first, content);
+					index.scan_html(active.data(), active.size());
+				}
+			}
+		}
+	}
+	for (auto &&x: css_safelist) index.add_safelist(x);
+}
+
+std::string Builder::active_lines(const SourceContainer &cont, const std::string &fname, std::string_view content) const {
+	std::string out;
+	Conditions cond(defines, fname);
+	for_each_line(content, [&](std::string_view line) {
+		if (cond.process(cont, line) || !cond.active()) return;
+		out.append(line).push_back('\n');
+	});
+	cond.finish();
+	return out;
+}
+
+void Builder::collapse(SourceContainer& block, std::ostream& outfile) {
+	auto files = block.getOrdered();
+	sources.prefetch(files);
+	for (auto &&x : files) {
+		includeFile(&block, outfile, x);
+	}
+	outfile << std::endl;
+}
+
 
 template<typename Out>
 void Builder::scan_variable(std::istream& in, Out && out) {
@@ -698,78 +2975,261 @@ void Builder::scan_variable(std::istream& in, Out && out) {
 }
 
 template<typename Out>
-void Builder::translate_file(const SourceContainer *cont, std::ifstream &in, Out&& out) {
+void Builder::translate_file(const SourceContainer *cont, const std::string &fname, std::string_view content, Out&& out) {
 	std::string x;
-	std::string tmp;
-	while (std::getline(in,x)) {
-		if (cont && cont->detect_require(x, tmp))
-			continue;
-		if (cont && cont->detect_include(x, tmp)) {
-			auto s = customContainers.find(tmp);
+	std::string_view tmp;
+	Conditions cond(defines, fname);
+	bool table = use_lang_table && cont && cont->extension == ".js";
+	bool imports = flatten_imports && cont && cont->extension == ".css";
+	CssImport imp;
+	JsScanState js;
+	for_each_line(content, [&](std::string_view line) {
+		if (cont && (cond.process(*cont, line) || !cond.active()))
+			return;
+		if (cont && cont->detect_require(line, tmp))
+			return;
+		if (cont && cont->detect_include(line, tmp)) {
+			auto s = customContainers.find(std::string(tmp));
 			if (s == customContainers.end()) {
-				throw std::runtime_error("Unable to include custom container: "+tmp);
+				throw std::runtime_error("Unable to include custom container: "+std::string(tmp));
 			}
 			if (!s->second.lock_container() ){
-				throw std::runtime_error("Recursive inclusion is not allowed: "+tmp);
+				throw std::runtime_error("Recursive inclusion is not allowed: "+std::string(tmp));
 			}
-			try {
-				for (auto &&x: s->second.getOrdered()) {
-					std::ifstream in(x);
-					if (!in) {
-						error_reading(x);
-					} else {
-						translate_file(cont, in, std::forward<Out>(out));
+			//the result depends on the comment syntax (directives) of the including container
+			std::string key = s->first + '\n' + cont->extension + '\n' + cont->comment_ps.prefix
+					+ '\n' + cont->comment_ps.suffix + (table?"\nT":"");
+			auto m = rendered_containers.find(key);
+			if (m == rendered_containers.end()) {
+				std::string buffer;
+				try {
+					auto members = s->second.getOrdered();
+					sources.prefetch(members);
+					for (auto &&x: members) {
+						const std::string *in = sources.get(x);
+						if (!in) {
+							error_reading(x);
+						} else {
+							translate_file(cont, x, *in, StringOut(buffer));
+						}
 					}
+				} catch (...) {
+					s->second.unlock_container();
+					throw;
 				}
-				s->second.unlock_container();
+				m = rendered_containers.emplace(std::move(key), std::move(buffer)).first;
+			}
+			s->second.unlock_container();
+			//the buffer ends by a newline, which is added by the output
+			if (!m->second.empty()) out(std::string_view(m->second).substr(0, m->second.length()-1));
+			return;
+		}
+		if (imports && line.find("@import") != line.npos && imp.parse(line)) {
+			std::string path = normalize_path(rel_to_abs(dirname(fname), imp.url));
+			if (std::find(import_stack.begin(), import_stack.end(), path) != import_stack.end()) {
+				throw std::runtime_error("Circular @import: "+path);
+			}
+			const std::string *in = sources.get(path);
+			if (!in) error_reading(path);
+			std::string buffer;
+			import_stack.push_back(path);
+			try {
+				translate_file(cont, path, *in, StringOut(buffer));
 			} catch (...) {
-				s->second.unlock_container();
+				import_stack.pop_back();
 				throw;
 			}
-
-			continue;
+			import_stack.pop_back();
+			//conditions of the import are converted to the blocks
+			int blocks = 0;
+			if (imp.has_layer) {
+				out(imp.layer.empty()?std::string("@layer {"):"@layer " + imp.layer + " {");
+				++blocks;
+			}
+			if (!imp.supports.empty()) {
+				out("@supports (" + imp.supports + ") {");
+				++blocks;
+			}
+			if (!imp.media.empty()) {
+				out("@media " + imp.media + " {");
+				++blocks;
+			}
+			if (!buffer.empty()) out(std::string_view(buffer).substr(0, buffer.length()-1));
+			while (blocks--) out("}");
+			return;
 		}
+		bool inline_enabled = cont && inline_limit;
+		if (line.find("{{") == line.npos && !inline_enabled) {
+			if (table) {
+				js.scan(line);
+				js.end_line();
+			}
+			out(line);
+			return;
+		}
+		x.clear();
 		std::size_t from = 0;
-		auto p = x.find("{{", from);
-		while (p != x.npos) {
-			auto q = x.find("}}",p+2);
-			if (q == x.npos) break;
-			std::string varname = x.substr(p+2,q-2-p);
+		std::string timestamp;
+		for_each_placeholder(line, [&](std::size_t p, std::size_t e) {
+			std::size_t q = e - 2;
+			x.append(line, from, p - from);
+			if (table) js.scan(line.substr(from, p - from));
+			std::string_view varname = line.substr(p+2,q-2-p);
+			std::string_view text;
 			auto l = langfile.find(varname);
 			if (l == langfile.end()) {
 				if (varname == "!timestamp") {
 					std::ostringstream buff;
 					buff << std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-					varname = buff.str();
+					timestamp = buff.str();
+					text = timestamp;
 				} else {
-					missing_lang.insert(varname);
+					if (missing_lang.find(varname) == missing_lang.end()) missing_lang.emplace(varname);
+					if (missing_log) missing_log->emplace_back(varname);
 					auto z = varname.rfind("::");
-					if (z != varname.npos) {
-						varname = varname.substr(z+2);
-					}
+					text = z == varname.npos?varname:varname.substr(z+2);
 				}
-				x = x.substr(0,p) + varname + x.substr(q+2);
-				from = p+varname.length();
 			} else {
-				x = x.substr(0,p) + l->second + x.substr(q+2);
-				from = p+l->second.length();
+				text = l->second;
 			}
-			p = x.find("{{", from);
+			if (table && !js.uncertain && js.in_comment()) {
+				//comments are kept language independent
+				x.append(line, p, q+2-p);
+			} else if (table && varname != "!timestamp" && (js.uncertain || js.regex || !js.quote || js.literal_only(line.substr(q+2)))) {
+				//a reference would change meaning of the code, the script depends on the language then
+				std::cerr << "Warning: " << fname << ": " << (js.uncertain?"unable to parse the script before"
+						:js.regex || !js.quote?"not in a string literal":"key of object or module name")
+						<< ", the text is inlined: {{" << varname << "}}" << std::endl;
+				x.append(text);
+			} else if (table && varname != "!timestamp") {
+				auto r = table_index.emplace(std::string(varname), table_texts.size());
+				if (r.second) table_texts.emplace_back(text);
+				std::string ref = "wappbuild_text[" + std::to_string(r.first->second) + "]";
+				if (js.quote == '`') x.append("${").append(ref).append("}");
+				else x.append(1, js.quote).append("+").append(ref).append("+").append(1, js.quote);
+			} else {
+				x.append(text);
+			}
+			from = e;
+		});
+		x.append(line, from, line.npos);
+		if (table) {
+			js.scan(line.substr(from));
+			js.end_line();
 		}
+		if (inline_enabled) inline_assets(*cont, fname, x);
 		out(x);
-	}
+	});
+	cond.finish();
 }
 
 void Builder::includeFile(const SourceContainer *cont, std::ostream& out, const std::string& fname) {
-	std::ifstream in(fname);
-	if (!in) {
-		error_reading(fname);
+	if (report_enabled && !report.empty()) {
+		std::ostringstream buff;
+		renderFile(cont, buff, fname);
+		std::string data = buff.str();
+		const std::string *src = sources.get(fname);
+		report.back().modules.push_back(ReportItem{fname, src?src->size():0, data.length(), report_gzip?gzip_estimate(data):0});
+		out.write(data.data(), data.length());
 	} else {
-		translate_file(cont, in, OStreamOut(out));
+		renderFile(cont, out, fname);
+	}
+}
+
+void Builder::renderFile(const SourceContainer *cont, std::ostream& out, const std::string& fname) {
+	const std::string *src = sources.get(fname);
+	if (!src) error_reading(fname);
+	bool imports = flatten_imports && cont && cont->extension == ".css" && src->find("@import") != src->npos;
+	if (cont && !inline_limit && !imports && is_plain_source(src->data(), src->size())) {
+		//passthrough, the result must be same as line by line translation
+		//the content read by the source cache is written in one call, without splitting to lines;
+		//the output is a stream (it can be minified or pruned), so it is still copied to the buffer
+		//of the output and then to the file
+		out.write(src->data(), src->size());
+		if (!src->empty() && src->back() != '\n') out.put('\n');
+		return;
+	}
+	if (!cache_dir.empty() && is_cacheable(cont, *src)) {
+		std::string entry_name = cache_entry_name(cont, *src);
+		std::string entry;
+		if (BatchReader::read_file(entry_name, entry) && replay_cache_entry(entry, out)) return;
+		std::vector<std::string> missing;
+		std::string buffer;
+		missing_log = &missing;
+		try {
+			translate_file(cont, fname, *src, StringOut(buffer));
+		} catch (...) {
+			missing_log = nullptr;
+			throw;
+		}
+		missing_log = nullptr;
+		//the entry starts by count of missing keys followed by the keys, one per line
+		entry = std::to_string(missing.size()) + '\n';
+		for (auto &&x: missing) entry.append(x).push_back('\n');
+		entry.append(buffer);
+		//other builds can write the same entry at the same time
+		std::string tmp = entry_name + temp_suffix();
+		std::ofstream f(tmp, std::ios::out|std::ios::trunc|std::ios::binary);
+		f.write(entry.data(), entry.length());
+		f.close();
+		if (!f || std::rename(tmp.c_str(), entry_name.c_str()) != 0) std::remove(tmp.c_str());
+		out.write(buffer.data(), buffer.length());
+		return;
+	}
+	translate_file(cont, fname, *src, OStreamOut(out));
+}
+
+bool Builder::is_cacheable(const SourceContainer *cont, const std::string &content) const {
+	//the result must depend only on the content, the used texts and the settings
+	if (!cont || inline_limit || (use_lang_table && cont->extension == ".js")) return false;
+	if (content.find("!include") != content.npos || content.find("{{!timestamp}}") != content.npos) return false;
+	if (flatten_imports && cont->extension == ".css" && content.find("@import") != content.npos) return false;
+	return true;
+}
+
+std::string Builder::cache_entry_name(const SourceContainer *cont, const std::string &content) const {
+	std::string ctx = "2\n" + cont->extension + '\n' + cont->comment_ps.prefix + '\n' + cont->comment_ps.suffix + '\n'
+			+ (flatten_imports?"I\n":"\n");
+	for (auto &&x: defines) ctx.append(x).push_back('\n');
+	std::uint64_t h = fnv1a(ctx.data(), ctx.length());
+	//only texts used by the file are part of the key, placeholders are found same way as translate_file does
+	for_each_line(content, [&](std::string_view line) {
+		for_each_placeholder(line, [&](std::size_t p, std::size_t e) {
+			std::string_view varname = line.substr(p+2, e-4-p);
+			auto l = langfile.find(varname);
+			h = fnv1a(varname.data(), varname.length(), h);
+			if (l == langfile.end()) {
+				h = fnv1a("\0", 1, h);
+			} else {
+				h = fnv1a("\1", 1, h);
+				h = fnv1a(l->second.data(), l->second.length(), h);
+			}
+		});
+	});
+	return cache_dir + path_separator + hash_to_string(fnv1a(content.data(), content.length()))
+			+ hash_to_string(h) + ".tr";
+}
+
+bool Builder::replay_cache_entry(const std::string &entry, std::ostream &out) {
+	std::size_t pos = entry.find('\n');
+	if (pos == entry.npos) return false;
+	std::size_t count = std::strtoul(entry.substr(0, pos).c_str(), nullptr, 10);
+	std::vector<std::string_view> missing;
+	std::string_view e(entry);
+	for (++pos; count; --count) {
+		auto nl = e.find('\n', pos);
+		if (nl == e.npos) return false;
+		missing.push_back(e.substr(pos, nl - pos));
+		pos = nl + 1;
+	}
+	for (auto &&x: missing) {
+		if (missing_lang.find(x) == missing_lang.end()) missing_lang.emplace(x);
 	}
+	out.write(entry.data() + pos, entry.length() - pos);
+	return true;
 }
 
-bool beginsWith(const std::string& subject, const char *test) {
+bool beginsWith(std::string_view subject, const char *test) {
 	auto l = subject.length();
 	auto i = l-l;
 	while (*test && i <l) {
@@ -780,7 +3240,7 @@ bool beginsWith(const std::string& subject, const char *test) {
 	return *test == 0;
 }
 
-bool endsWith(const std::string& subject, const char *test) {
+bool endsWith(std::string_view subject, const char *test) {
 
 	unsigned int cnt = 0;
 	const char *a = test;
@@ -797,6 +3257,173 @@ bool endsWith(const std::string& subject, const char *test) {
 	return true;
 }
 
+namespace DataURI {
+
+const char *mime_type(const std::string &fname) {
+	static const char *types[][2] = {
+			{".png","image/png"},
+			{".gif","image/gif"},
+			{".jpg","image/jpeg"},
+			{".jpeg","image/jpeg"},
+			{".svg","image/svg+xml"},
+			{".webp","image/webp"},
+			{".ico","image/x-icon"},
+			{".bmp","image/bmp"},
+			{".woff","font/woff"},
+			{".woff2","font/woff2"},
+			{".ttf","font/ttf"},
+			{".otf","font/otf"},
+	};
+	for (auto &&x: types) {
+		if (endsWith(fname, x[0])) return x[1];
+	}
+	return nullptr;
+}
+
+///Encodes binary data to base64
+/** Every 3 input bytes are converted by two lookups to a table of pairs of output
+ * characters (12 bits per lookup), which halves the count of lookups and stores
+ */
+void base64(const std::string &data, std::string &out) {
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const std::vector<char> pairs = []{
+		std::vector<char> res(8192);
+		for (unsigned int i = 0; i < 4096; i++) {
+			res[i*2] = alphabet[i >> 6];
+			res[i*2+1] = alphabet[i & 0x3F];
+		}
+		return res;
+	}();
+
+	auto s = reinterpret_cast<const unsigned char *>(data.data());
+	auto len = data.length();
+	auto pos = out.length();
+	out.resize(pos + (len+2)/3*4);
+	char *o = &out[pos];
+	const char *p = pairs.data();
+	std::size_t i = 0;
+	for (; i + 3 <= len; i+=3, o+=4) {
+		unsigned int v = (s[i] << 16) | (s[i+1] << 8) | s[i+2];
+		const char *a = p + (v >> 12) * 2;
+		const char *b = p + (v & 0xFFF) * 2;
+		o[0] = a[0]; o[1] = a[1]; o[2] = b[0]; o[3] = b[1];
+	}
+	if (i < len) {
+		unsigned int v = s[i] << 16;
+		if (i + 1 < len) v |= s[i+1] << 8;
+		o[0] = alphabet[v >> 18];
+		o[1] = alphabet[(v >> 12) & 0x3F];
+		o[2] = i + 1 < len?alphabet[(v >> 6) & 0x3F]:'=';
+		o[3] = '=';
+	}
+}
+
+///Finds references to assets in the line of the source
+/**
+ * @param extension extension of the container - specifies type of the source
+ * @param line line to scan
+ * @param fn function called with position and length of each reference found
+ */
+template<typename Fn>
+void scan_refs(const std::string &extension, const std::string &line, Fn &&fn) {
+	bool is_css = extension == ".css";
+	if (!is_css && extension != ".html" && extension != ".htm" && extension != ".hdr") return;
+	std::size_t p = 0;
+	while (true) {
+		std::size_t b;
+		if (is_css) {
+			p = line.find("url(",p);
+			if (p == line.npos) return;
+			b = p + 4;
+			while (b < line.length() && isspace(line[b])) ++b;
+		} else {
+			p = line.find("<img",p);
+			if (p == line.npos) return;
+			auto t = line.find('>',p);
+			b = line.find("src=",p);
+			if (b == line.npos || b > t) {p+=4;continue;}
+			b += 4;
+		}
+		if (b >= line.length()) return;
+		char term = line[b];
+		if (term == '"' || term == '\'') ++b;
+		else term = is_css?')':' ';
+		auto e = b;
+		while (e < line.length() && line[e] != term && (is_css || line[e] != '>')) ++e;
+		if (e >= line.length() && term != ' ') return;
+		while (is_css && term == ')' && e > b && isspace(line[e-1])) --e;
+		fn(b, e-b);
+		p = e;
+	}
+}
+
+bool is_local(const std::string &url) {
+	if (url.empty() || url[0] == '/' || url[0] == '#') return false;
+	return url.find_first_of(":?#") == url.npos;
+}
+
+}
+
+std::string Builder::resolve_asset(const SourceContainer &cont, const std::string &fname, const std::string &url) const {
+	//url() in styles is relative to the stylesheet, src in html is relative to the page
+	if (cont.extension == ".css") return rel_to_abs(dirname(fname), url);
+	else return rel_to_abs(root_dir, url);
+}
+
+const std::string *Builder::load_asset(const std::string &path) {
+	auto iter = inlined_assets.find(path);
+	if (iter == inlined_assets.end()) {
+		std::string &uri = inlined_assets[path];
+		const char *mime = DataURI::mime_type(path);
+		std::ifstream in(path, std::ios::in|std::ios::binary|std::ios::ate);
+		if (mime && !!in && static_cast<std::size_t>(in.tellg()) <= inline_limit) {
+			std::string data(static_cast<std::size_t>(in.tellg()), 0);
+			in.seekg(0);
+			if (in.read(&data[0], data.length())) {
+				uri.append("data:").append(mime).append(";base64,");
+				DataURI::base64(data, uri);
+			}
+		}
+		return uri.empty()?nullptr:&uri;
+	}
+	return iter->second.empty()?nullptr:&iter->second;
+}
+
+void Builder::inline_assets(const SourceContainer &cont, const std::string &fname, std::string &line) {
+	std::string res;
+	std::size_t last = 0;
+	DataURI::scan_refs(cont.extension, line, [&](std::size_t pos, std::size_t len) {
+		std::string url = line.substr(pos, len);
+		if (!DataURI::is_local(url)) return;
+		const std::string *uri = load_asset(resolve_asset(cont, fname, url));
+		if (uri == nullptr) return;
+		res.append(line, last, pos - last);
+		res.append(*uri);
+		last = pos + len;
+	});
+	if (last) {
+		res.append(line, last, line.npos);
+		std::swap(res, line);
+	}
+}
+
+void Builder::collect_assets(const SourceContainer &cont, std::unordered_set<std::string> &files) {
+	for (auto &&x: cont) {
+		std::ifstream in(x.first);
+		std::string line;
+		Conditions cond(defines, x.first);
+		while (std::getline(in, line)) {
+			if (cond.process(cont, line) || !cond.active()) continue;
+			DataURI::scan_refs(cont.extension, line, [&](std::size_t pos, std::size_t len) {
+				std::string url = line.substr(pos, len);
+				if (!DataURI::is_local(url)) return;
+				std::string path = resolve_asset(cont, x.first, url);
+				if (load_asset(path)) files.insert(path);
+			});
+		}
+	}
+}
+
 SourceContainer  &Builder::chooseContainer(SourceContainer & current, std::string &fname) {
 	if (fname.empty()) {
 		throw std::runtime_error("'require' of empty filename");
@@ -811,70 +3438,149 @@ SourceContainer  &Builder::chooseContainer(SourceContainer & current, std::strin
 }
 
 
-bool SourceContainer::detect_require(const std::string &line, std::string &rest) const {
+bool SourceContainer::detect_require(std::string_view line, std::string_view &rest) const {
 	return detect_directive(line, rest,"!require");
 }
-bool SourceContainer::detect_include(const std::string &line, std::string &rest) const {
+bool SourceContainer::detect_include(std::string_view line, std::string_view &rest) const {
 	return detect_directive(line, rest,"!include");
 }
 
-bool SourceContainer::detect_directive(const std::string &line, std::string &rest, const char *directive) const {
+bool SourceContainer::detect_directive(std::string_view line, std::string_view &rest, const char *directive) const {
 
 	if (line.empty()) return false;
 	if (isspace(line[0])) {
-		rest = trim(line,isspace);
-		return detect_require(rest, rest);
+		return detect_require(trim(line,isspace), rest);
+	}
+	std::string_view r;
+	if (detect_comment(line, r) && checkKw(directive, r)) {
+		rest = r;
+		return true;
 	}
-	if (beginsWith(line,comment_ps.prefix.c_str())
+	return false;
+
+}
+
+bool SourceContainer::detect_comment(std::string_view line, std::string_view &content) const {
+	if (line.length() >= comment_ps.prefix.length() + comment_ps.suffix.length()
+	  && beginsWith(line,comment_ps.prefix.c_str())
 	  && endsWith(line,comment_ps.suffix.c_str())) {
-		rest = trim(line.substr(comment_ps.prefix.length(), line.length() - comment_ps.prefix.length() - comment_ps.suffix.length()),isspace);
-		if (checkKw(directive, rest)) {
-			return true;
-		}
+		content = trim(line.substr(comment_ps.prefix.length(), line.length() - comment_ps.prefix.length() - comment_ps.suffix.length()),isspace);
+		return true;
 	}
 	return false;
+}
+
+bool Conditions::process(std::string_view directive) {
+	if (checkKw("!if", directive)) {
+		bool neg = beginsWith(directive, "!");
+		if (neg) directive = trim(directive.substr(1), isspace);
+		bool taken = (defines.find(directive) != defines.end()) != neg;
+		blocks.push_back(Block{taken, false});
+		if (!taken) ++inactive;
+	} else if (directive == "!else") {
+		if (blocks.empty() || blocks.back().has_else)
+			throw std::runtime_error("Unexpected !else: " + fname);
+		Block &b = blocks.back();
+		if (!b.taken) --inactive;
+		b.taken = !b.taken;
+		b.has_else = true;
+		if (!b.taken) ++inactive;
+	} else if (directive == "!endif") {
+		if (blocks.empty())
+			throw std::runtime_error("Unexpected !endif: " + fname);
+		if (!blocks.back().taken) --inactive;
+		blocks.pop_back();
+	} else {
+		return false;
+	}
+	return true;
+}
 
+void Conditions::finish() const {
+	if (!blocks.empty()) throw std::runtime_error("Missing !endif: " + fname);
 }
 
-void Builder::walk_includes(SourceContainer &curContainer, std::string fname, bool force_container) {
+void Builder::walk_includes(SourceContainer &curContainer, std::string fname, bool force_container, const std::string &parent) {
 	SourceContainer  &container = force_container?curContainer:chooseContainer(curContainer, fname);
+	if (required_by.find(fname) == required_by.end()) {
+		required_by.emplace(arena.store(fname), arena.store(parent));
+	}
 
 	if (container.lock(fname)) {
-		std::ifstream f(fname);
+		const std::string *f = sources.get(fname);
 		if (!f)  {
 			error_reading(fname);
 		}
 
-		std::string line;
-		std::string tline;
-
-		while (!!f) {
-			std::getline(f,line);
-			tline = trim(line, isspace);
-			if (container.detect_require(tline, line)) {
-				if (beginsWith(line,"@")) {
-					auto p = line.find(' ');
-					if (p == line.npos) {
+		struct Required {
+			SourceContainer *cont;
+			std::string fname;
+			bool force;
+		};
+		std::vector<Required> required;
+
+		const char *data = f->data();
+		const char *end = data + f->size();
+		const char *p = data;
+		std::string_view rest;
+		Conditions cond(defines, fname);
+
+		//a line without '!' can't be a directive, jump to the next '!'
+		while ((p = static_cast<const char *>(std::memchr(p, '!', end - p))) != nullptr) {
+			const char *b = p;
+			while (b != data && b[-1] != '\n') --b;
+			const char *e = static_cast<const char *>(std::memchr(p, '\n', end - p));
+			if (e == nullptr) e = end;
+			p = e;
+			std::string_view line = trim(std::string_view(b, e - b), isspace);
+			if (cond.process(container, line) || !cond.active()) continue;
+			if (container.detect_require(line, rest)) {
+				if (beginsWith(rest,"@")) {
+					auto p = rest.find(' ');
+					if (p == rest.npos) {
 						throw std::runtime_error("'require' invalid format: "+fname);
 					}
-					std::string name = trim(line.substr(0,p),isspace);
-					line = trim(line.substr(p+1),isspace);
+					std::string name(trim(rest.substr(0,p),isspace));
+					rest = trim(rest.substr(p+1),isspace);
 
 					auto s = customContainers.find(name);
 					if (s == customContainers.end()) {
 						if (name == "@hdr" || name == "@header") {
-							walk_includes(header, rel_to_abs(dirname(fname), line), true);
+							required.push_back(Required{&header, rel_to_abs(dirname(fname), rest), true});
 						} else {
 							throw std::runtime_error("Output file is not defined: "+fname);
 						}
 					} else {
-						walk_includes(s->second, rel_to_abs(dirname(fname), line), true);
+						required.push_back(Required{&s->second, rel_to_abs(dirname(fname), rest), true});
 					}
 				} else {
-					walk_includes(container, rel_to_abs(dirname(fname), line), false);
+					//an imported stylesheet is inlined, but its own requirements are emitted as usual
+					SourceContainer *target = &container == &imported_styles?&styles:&container;
+					required.push_back(Required{target, rel_to_abs(dirname(fname), rest), false});
 				}
 			}
 		}
+		cond.finish();
+		if (flatten_imports && container.extension == ".css" && std::string_view(data, f->size()).find("@import") != std::string_view::npos) {
+			//imports in excluded blocks are not part of the graph
+			Conditions cond(defines, fname);
+			CssImport imp;
+			for_each_line(std::string_view(data, f->size()), [&](std::string_view line) {
+				line = trim(line, isspace);
+				if (cond.process(container, line) || !cond.active()) return;
+				if (line.find("@import") != line.npos && imp.parse(line)) {
+					required.push_back(Required{&imported_styles, normalize_path(rel_to_abs(dirname(fname), imp.url)), true});
+				}
+			});
+		}
+		std::vector<std::string> names;
+		for (auto &&x: required) names.push_back(x.fname);
+		//read all required files at once, before they are walked
+		if (names.size() > 1) sources.prefetch(names);
+		require_graph[fname] = std::move(names);
+		for (auto &&x: required) {
+			walk_includes(*x.cont, x.fname, x.force, fname);
+		}
 		container.commit(fname);
 	}
 
@@ -894,7 +3600,97 @@ void Builder::gen_lang_file(const std::string &langfile) {
 			out.put(',');
 			write_string(out, x.substr(pos+2));
 		}
-		out << ",\"\"\r\n";
+		out << ",\"\"";
+		auto refs = missing_lang_refs.find(x);
+		if (refs != missing_lang_refs.end()) {
+			std::string lst;
+			for (auto &&r: refs->second) {
+				if (!lst.empty()) lst.push_back(' ');
+				lst.append(r);
+			}
+			out.put(',');
+			write_string(out, lst);
+		}
+		out << "\r\n";
+	}
+}
+
+void KeyScanner::scan_file(const std::string &fname, const SourceContainer *cont, Refs &refs) const {
+	MappedFile in(fname);
+	if (!in) throw std::runtime_error("Error opening (reading) the file: " + fname);
+	std::string_view tmp;
+	unsigned int line = 0;
+	Conditions cond(defines, fname);
+	for_each_line(std::string_view(in.data(), in.size()), [&](std::string_view x) {
+		++line;
+		//page files have directives on plain lines
+		if (cont?cond.process(*cont, x):cond.process(trim(x, isspace))) return;
+		if (!cond.active()) return;
+		if (cont && (cont->detect_require(x, tmp) || cont->detect_include(x, tmp)))
+			return;
+		for_each_placeholder(x, [&](std::size_t p, std::size_t e) {
+			refs.push_back(Ref{std::string(x.substr(p+2,e-4-p)), line});
+		});
+	});
+	cond.finish();
+}
+
+void KeyScanner::scan(const FileList &files) {
+	std::vector<std::pair<const FileList::value_type *, Refs *> > jobs;
+	for (auto &&x: files) {
+		auto ins = cache.insert(std::make_pair(x.first, Refs()));
+		if (ins.second) jobs.push_back(std::make_pair(&x, &ins.first->second));
+	}
+
+	std::atomic<std::size_t> next(0);
+	std::exception_ptr error;
+	std::atomic<bool> failed(false);
+	auto worker = [&] {
+		std::size_t idx;
+		while (!failed && (idx = next++) < jobs.size()) {
+			try {
+				scan_file(jobs[idx].first->first, jobs[idx].first->second, *jobs[idx].second);
+			} catch (...) {
+				if (!failed.exchange(true)) error = std::current_exception();
+			}
+		}
+	};
+	std::size_t count = std::min<std::size_t>(std::max(1U, std::thread::hardware_concurrency()), jobs.size());
+	std::vector<std::thread> threads;
+	for (std::size_t i = 1; i < count; i++) threads.emplace_back(worker);
+	worker();
+	for (auto &&t: threads) t.join();
+	if (error) {
+		for (auto &&x: jobs) cache.erase(x.first->first);
+		std::rethrow_exception(error);
+	}
+}
+
+void Builder::scan_lang_keys(KeyScanner &scanner, bool collapsed) {
+	KeyScanner::FileList files;
+	for (auto &&x: page_files) files.push_back(std::make_pair(x, nullptr));
+	std::vector<const SourceContainer *> list {&templates, &header};
+	if (collapsed) {
+		list.push_back(&styles);
+		list.push_back(&imported_styles);
+		list.push_back(&scripts);
+	}
+	for (auto &&y: customContainers) list.push_back(&y.second);
+	for (auto &&y: list) {
+		for (auto &&x: y->getOrdered()) files.push_back(std::make_pair(x, y));
+	}
+	scanner.scan(files);
+
+	missing_lang.clear();
+	missing_lang_refs.clear();
+	for (auto &&x: files) {
+		for (auto &&r: scanner.get(x.first)) {
+			if (r.key == "!timestamp" || langfile.find(r.key) != langfile.end()) continue;
+			missing_lang.insert(r.key);
+			std::ostringstream loc;
+			loc << x.first << ":" << r.line;
+			missing_lang_refs[r.key].push_back(loc.str());
+		}
 	}
 }
 
@@ -921,14 +3717,25 @@ int main(int argc, char **argv) {
 		std::string dep_target;
 		std::string lang_file;
 		std::string gen_lang_file;
+		std::vector<std::string> lang_files;
+		std::vector<std::string> gen_lang_files;
 		std::string infile;
+		std::vector<std::string> infiles;
+		std::string common_name = "common";
+		std::size_t min_pages = 0;
 		std::string root_dir;
 		std::string base_name;
+		std::string report_file;
+		std::vector<std::string> defines;
+		std::string store_dir;
+		std::string cache_dir;
 		const char *sw_end="e";
 
 		bool collapse = false;
 		bool nooutput = false;
 		bool phony = false;
+		bool scan_only = false;
+		bool report_gzip = false;
 
 		const char *x = nextParam(false);
 		while (x) {
@@ -942,9 +3749,17 @@ int main(int argc, char **argv) {
 					case 'D': root_dir = nextParam(true);x = sw_end; break;
 					case 'd': dep_file = nextParam(true);x = sw_end; break;
 					case 't': dep_target = nextParam(true);x = sw_end; break;
-					case 'L': lang_file = nextParam(true);x = sw_end; break;
-					case 'G': gen_lang_file = nextParam(true);x = sw_end; break;
+					case 's': scan_only = true;break;
+					case 'z': report_gzip = true;break;
+					case 'R': report_file = nextParam(true);x = sw_end; break;
+					case 'L': lang_file = nextParam(true);lang_files.push_back(lang_file);x = sw_end; break;
+					case 'G': gen_lang_file = nextParam(true);gen_lang_files.push_back(gen_lang_file);x = sw_end; break;
 					case 'B': base_name = nextParam(true);x = sw_end; break;
+					case 'm': min_pages = std::strtoul(nextParam(true),nullptr,10);x = sw_end; break;
+					case 'C': common_name = nextParam(true);x = sw_end; break;
+					case 'F': defines.push_back(nextParam(true));x = sw_end; break;
+					case 'S': store_dir = nextParam(true);x = sw_end; break;
+					case 'T': cache_dir = nextParam(true);x = sw_end; break;
 					case 'l':
 						std::cerr << "Switch -l is no longer supported " << x << std::endl;
 						return 1;
@@ -956,12 +3771,13 @@ int main(int argc, char **argv) {
 			} else {
 				if (infile.empty())
 					infile = x;
-				else
-					std::cerr << "Only one file can be input file" << std::endl;
-
+				infiles.push_back(x);
 			}
 			x = nextParam(false);
 		}
+		if (infiles.size() > 1 && !min_pages) {
+			std::cerr << "Only one file can be input file" << std::endl;
+		}
 
 		if (infile.empty()) {
 				std::cerr << "Copyright (c) 2018 Ondrej Novak" << std::endl
@@ -988,7 +3804,7 @@ int main(int argc, char **argv) {
 						<< "OTHER DEALINGS IN THE SOFTWARE."<< std::endl<< std::endl
 						<< "Usage: " << std::endl
 						<<std::endl
-						<< argv[0] << " [-c][-x][-p][-d <depfile>][-t <target>][-L <langfile>][-G <langfile>][-B basename] <input.page>" <<std::endl
+						<< argv[0] << " [-c][-x][-p][-s][-z][-d <depfile>][-R <report>][-m <n> [-C <name>]][-F <name>][-S <dir>][-T <dir>][-t <target>][-L <langfile>][-G <langfile>][-B basename] <input.page>" <<std::endl
 						<<std::endl
 						<< "<input.page>    file contains commands and references to various modules (described below)"<<std::endl
 						<< "-d  <depfile>   generated dependency file (for make)" <<std::endl
@@ -997,8 +3813,23 @@ int main(int argc, char **argv) {
 						<< "-L  <langfile>  language file (csv)" <<std::endl
 						<< "-G  <langfile>  output generated lang file (csv)" <<std::endl
 						<< "-B  <name>      override basename"<<std::endl
+						<< "-R  <report>    write sizes of modules in every output (json). A sorted summary" <<std::endl
+						<< "                is written to the file with extension .txt" <<std::endl
+						<< "-z              add estimation of gzip compressed size to the report" <<std::endl
+						<< "-m  <n>         build multiple pages (<input.page>...), scripts and styles required" <<std::endl
+						<< "                by at least <n> pages are collapsed to shared files loaded first" <<std::endl
+						<< "-C  <name>      basename of the shared files (default: common)" <<std::endl
+						<< "-F  <name>      define the name for conditional blocks (!if <name>). Can be repeated" <<std::endl
+						<< "-S  <dir>       store every distinct output once in <dir> under hash of its content" <<std::endl
+						<< "                and create outputs as hard links to the stored files" <<std::endl
+						<< "-T  <dir>       cache of translated files, a file is translated again only when" <<std::endl
+						<< "                its content or a text it uses is changed" <<std::endl
 						<< "-x              do not generate output. Useful with -d (-xd depfile)" <<std::endl
 						<< "-c              collapse scripts and styles into single file(s)" <<std::endl
+						<< "-s              scan for missing language keys only, no output is generated" <<std::endl
+						<< "                Multiple pairs '-L <langfile> -G <langfile>' can be specified." <<std::endl
+						<< "                Locations of the keys are written to the fourth column. Add -c to" <<std::endl
+						<< "                include keys from scripts and styles" <<std::endl
 						<< std::endl
 						<< "Page file format" <<std::endl
 						<< std::endl
@@ -1032,8 +3863,25 @@ int main(int argc, char **argv) {
 						<< "                       example: '!entry_point main()'" <<std::endl
 						<< "!defer_script yes  - script is loaded with defer flag. " <<std::endl
 						<< "!defer_css yes     - styles are loaded after scripts. " <<std::endl
+						<< "!defer_css early   - styles are loaded from the header without blocking render. " <<std::endl
+						<< "!lang_table yes    - texts of collapsed scripts are loaded from <basename>_text.js, " <<std::endl
+						<< "                       so the scripts don't depend on the language " <<std::endl
+						<< "!flatten_imports yes - @import of local stylesheets is replaced by the stylesheet " <<std::endl
+						<< "!minify_html yes   - remove comments and redundant whitespace from generated html. " <<std::endl
+						<< "!prune_css yes     - remove rules not matching templates from collapsed styles. " <<std::endl
+						<< "!css_safelist <items> - classes (.name), ids (#name) and tags kept by !prune_css. " <<std::endl
+						<< "                       Trailing * matches any suffix" <<std::endl
+						<< "!service_worker <file> - generate service worker which precaches all outputs of the page" <<std::endl
+						<< "                       The path is relative to the root script" <<std::endl
+						<< "!register_service_worker yes - register the service worker in the page" <<std::endl
 						<< "!container @name file  - Creates container which is generated to a file. " <<std::endl
 						<< "!container @name   - Creates container which can be included. " <<std::endl
+						<< "!lazy_html <module> - include module, its html is put to <template id=name>. " <<std::endl
+						<< "!lazy_html <module> <file> - include module, its html is written to a separate file. " <<std::endl
+						<< "!lazy <name> <module>... - put modules to the chunk loaded by wappbuild_load(\"<name>\"). " <<std::endl
+						<< "                       Files required also by the page or other chunks are not lazy" <<std::endl
+						<< "!inline_assets <n> - replace local images and fonts up to <n> bytes referenced " <<std::endl
+						<< "                       by url() in styles and <img src> in templates by data: URIs" <<std::endl
 						<< std::endl
 						<< "In source references" <<std::endl
 						<< std::endl
@@ -1047,6 +3895,13 @@ int main(int argc, char **argv) {
 						<< "referenced files are also included to the project. However circular" << std::endl
 						<< "references are not allowed resulting to break the cycle once it is detected" << std::endl
 						<< std::endl
+						<< "Conditional blocks" <<std::endl
+						<< std::endl
+						<< "Lines between '!if <name>' and '!endif' are excluded, unless the name is" << std::endl
+						<< "defined by -F. The condition '!if !<name>' is inverted. The block can contain" << std::endl
+						<< "'!else'. In source files, the directives are written as comments (//!if debug)" << std::endl
+						<< "Excluded !require directives are not part of the project" << std::endl
+						<< std::endl
 						<< "Custom output"
 						<< std::endl
 						<< "Command '!require @name file' causes that file will be put into custom output file" << std::endl
@@ -1071,11 +3926,111 @@ int main(int argc, char **argv) {
 				return 1;
 		}
 
+		for (auto &&d: {store_dir, cache_dir}) {
+			if (d.empty()) continue;
+#ifdef _WIN32
+			int r = _mkdir(d.c_str());
+#else
+			int r = mkdir(d.c_str(), 0777);
+#endif
+			if (r != 0 && errno != EEXIST) {
+				std::cerr << "Unable to create directory: " << d << std::endl;
+				return 1;
+			}
+		}
+
+		if (scan_only) {
+			if (lang_files.empty() || lang_files.size() != gen_lang_files.size()) {
+				std::cerr << "Switch -s requires pairs of -L <langfile> -G <langfile>" << std::endl;
+				return 1;
+			}
+			KeyScanner scanner(Conditions::Defines(defines.begin(), defines.end()));
+			for (std::size_t i = 0; i < lang_files.size(); i++) {
+				Builder builder;
+				for (auto &&d: defines) builder.define(d);
+				//a new language starts with an empty or missing file, it has no keys then
+				try {
+					builder.parse_lang_file(lang_files[i]);
+				} catch (std::exception &e) {
+					std::cerr << "Warning: " << e.what() << std::endl;
+				}
+				builder.parse_page_file(infile);
+				builder.scan_lang_keys(scanner, collapse);
+				builder.gen_lang_file(gen_lang_files[i]);
+			}
+			return 0;
+		}
+
+		if (min_pages) {
+			if (!collapse) {
+				std::cerr << "Switch -m requires -c" << std::endl;
+				return 1;
+			}
+			if (!base_name.empty() || !gen_lang_file.empty() || !report_file.empty()) {
+				std::cerr << "Switches -B, -G and -R cannot be combined with -m" << std::endl;
+				return 1;
+			}
+			std::vector<std::unique_ptr<Builder> > builders;
+			std::vector<Builder *> pages;
+			for (auto &&f: infiles) {
+				builders.emplace_back(new Builder);
+				Builder &builder = *builders.back();
+				for (auto &&d: defines) builder.define(d);
+				builder.set_output_store(store_dir, dep_target);
+				builder.set_translation_cache(cache_dir);
+				if (!lang_file.empty()) {
+					try {
+						builder.parse_lang_file(lang_file);
+					} catch (std::exception &e) {
+						std::cerr << "Warning: " << e.what() << std::endl;
+					}
+				}
+				builder.parse_page_file(f);
+				if (!root_dir.empty()) {
+					builder.set_root_dir(root_dir);
+				}
+				pages.push_back(&builder);
+			}
+			if (!dep_file.empty()) {
+				std::unordered_set<std::string> files;
+				std::string target = dep_target;
+				for (auto &&b: pages) {
+					b->collect_deps(files, true);
+					if (dep_target.empty()) target.append(target.empty()?"":" ").append(b->get_output_name());
+				}
+				write_dep_file(dep_file, target, files, phony);
+			}
+			if (!nooutput) {
+				Builder::extract_common(pages, min_pages, common_name);
+				for (auto &&b: pages) {
+					b->collapse_externals();
+					b->build_output();
+					b->collapse_customs();
+					b->gen_service_worker();
+				}
+			}
+			return 0;
+		}
+
+		if (lang_files.size() > 1 || gen_lang_files.size() > 1) {
+			std::cerr << "Multiple -L or -G are allowed only with -s" << std::endl;
+			return 1;
+		}
+
 		Builder builder;
+		for (auto &&d: defines) builder.define(d);
+		builder.set_output_store(store_dir, dep_target);
+		builder.set_translation_cache(cache_dir);
 
 		if (nooutput && !gen_lang_file.empty()) {
 			std::cerr<<"Warning: No language file will be generated, the flag -G is ignored when -x is active" << std::endl;
 		}
+		if (nooutput && !report_file.empty()) {
+			std::cerr<<"Warning: No report will be generated, the flag -R is ignored when -x is active" << std::endl;
+		}
+		if (!report_file.empty()) {
+			builder.enable_report(report_gzip);
+		}
 
 		if (!lang_file.empty()) {
 			try {
@@ -1104,9 +4059,13 @@ int main(int argc, char **argv) {
 			if (collapse) builder.collapse_externals();
 			builder.build_output();
 			builder.collapse_customs();
+			builder.gen_service_worker();
 			if (!gen_lang_file.empty()) {
 				builder.gen_lang_file(gen_lang_file);
 			}
+			if (!report_file.empty()) {
+				builder.write_report(report_file);
+			}
 		}
 
 	} catch (std::exception &e) {
@@ -0,0 +1,3 @@
+var s = "{{ x";
+var k = "TWO";
+
@@ -0,0 +1,2 @@
+var s = "{{ x";
+var k = "{{k}}";
@@ -0,0 +1,2 @@
+var lib = 1;
+
@@ -0,0 +1 @@
+var lib = 1;
@@ -0,0 +1,14 @@
+var re = /'/; var c = ""+wappbuild_text[0]+"";
+var cls = /["[]/g.test(c) ? ""+wappbuild_text[0]+"" : 'x';
+var n = 5 + 1;
+var half = (n + 1) / 2; var d = ""+wappbuild_text[0]+"";
+if (n) /"/.test(d); var e = ""+wappbuild_text[0]+"";
+// {{greet}}
+var o = {}
+/'/.test(e); var f = "Hello";
+import m from "./mod.js";
+export {x as "Hello"} from "./x.js";
+var o = {"Hello": 1, 'b': ""+wappbuild_text[0]+""};
+var t = o ? ""+wappbuild_text[0]+"" : ""+wappbuild_text[0]+"";
+var p = {k: ""+wappbuild_text[0]+"", "Hello" : 2};
+
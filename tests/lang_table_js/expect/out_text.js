@@ -0,0 +1,2 @@
+var wappbuild_text=[
+"Hello"];
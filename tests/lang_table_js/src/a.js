@@ -0,0 +1,8 @@
+var re = /'/; var c = "{{greet}}";
+var cls = /["[]/g.test(c) ? "{{greet}}" : 'x';
+var n = {{count}} + 1;
+var half = (n + 1) / 2; var d = "{{greet}}";
+if (n) /"/.test(d); var e = "{{greet}}";
+// {{greet}}
+var o = {}
+/'/.test(e); var f = "{{greet}}";
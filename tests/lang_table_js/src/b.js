@@ -0,0 +1,5 @@
+import m from "./{{mod}}.js";
+export {x as "{{greet}}"} from "./x.js";
+var o = {"{{greet}}": 1, 'b': "{{greet}}"};
+var t = o ? "{{greet}}" : "{{greet}}";
+var p = {k: "{{greet}}", "{{greet}}" : 2};
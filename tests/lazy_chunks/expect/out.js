@@ -0,0 +1,4 @@
+var util = 1;
+var main = 1;
+var shared = 1;
+
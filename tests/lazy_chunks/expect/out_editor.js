@@ -0,0 +1,2 @@
+var editor = 1;
+
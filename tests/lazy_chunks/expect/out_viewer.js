@@ -0,0 +1,2 @@
+var viewer = 1;
+
@@ -0,0 +1,3 @@
+//!require util.js
+//!require shared.js
+var editor = 1;
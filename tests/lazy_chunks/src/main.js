@@ -0,0 +1,2 @@
+//!require util.js
+var main = 1;
@@ -0,0 +1 @@
+var util = 1;
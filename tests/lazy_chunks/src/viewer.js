@@ -0,0 +1,2 @@
+//!require shared.js
+var viewer = 1;
@@ -0,0 +1,2 @@
+//!require shared.html
+var main = 1;
@@ -0,0 +1,3 @@
+//!require c.js
+//!require d.js
+var a = 1;
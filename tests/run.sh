@@ -0,0 +1,32 @@
+#!/bin/sh
+# Runs regression cases. Every directory with a 'cmd' file is a case:
+# it is copied to a scratch directory, 'cmd' is executed there by the shell
+# with $WAPPBUILD set to the tested binary (stderr is captured to 'stderr')
+# and every file in 'expect' must match the produced file of the same path.
+
+WAPPBUILD=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+export WAPPBUILD
+TESTS=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failed=0
+
+for case in "$TESTS"/*/; do
+	name=$(basename "$case")
+	[ -f "$case/cmd" ] || continue
+	mkdir "$WORK/$name"
+	cp -R "$case"/. "$WORK/$name"
+	(cd "$WORK/$name" && set -e && . ./cmd 2>stderr) || {
+		echo "FAIL $name: command failed"; cat "$WORK/$name/stderr"; failed=1; continue
+	}
+	for file in $(cd "$case/expect" 2>/dev/null && find . -type f); do
+		if ! cmp -s "$case/expect/$file" "$WORK/$name/$file"; then
+			echo "FAIL $name: $file"
+			diff "$case/expect/$file" "$WORK/$name/$file"
+			failed=1
+		fi
+	done
+done
+
+[ $failed = 0 ] && echo "All tests passed"
+exit $failed
@@ -0,0 +1,11 @@
+"use strict";
+var PRECACHE = {
+	"p.html":"e890ff3e733b8510",
+	"p.css":"af63c74c8601c8dd",
+	"p.js":"4216132747904826"
+};
+var CACHE_PREFIX = "wappbuild:p.html:";
+var CACHE = CACHE_PREFIX + "3be89a8062738f8f";
+self.addEventListener("install",function(ev){ev.waitUntil(caches.open(CACHE).then(function(c){return c.addAll(Object.keys(PRECACHE));}).then(function(){return self.skipWaiting();}));});
+self.addEventListener("activate",function(ev){ev.waitUntil(caches.keys().then(function(keys){return Promise.all(keys.filter(function(k){return k.indexOf(CACHE_PREFIX) == 0 && k != CACHE;}).map(function(k){return caches.delete(k);}));}).then(function(){return self.clients.claim();}));});
+self.addEventListener("fetch",function(ev){if (ev.request.method != "GET") return;ev.respondWith(caches.open(CACHE).then(function(c){return c.match(ev.request,{ignoreSearch:true});}).then(function(r){return r || fetch(ev.request);}));});